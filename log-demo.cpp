@@ -35,7 +35,7 @@ int main() {
 
     tlog::success() << "Progress finished after " << tlog::durationToString(progress.duration());
 
-    auto scopedLogger = tlog::Logger("inner scope");
+    auto scopedLogger = tlog::Logger::global()->child("inner scope");
     scopedLogger.info("This info message is written by a scoped logger.");
     progress = scopedLogger.progress(N);
     for (int i = 1; i <= N; ++i) {
@@ -4,14 +4,34 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef TLOG_USE_ZLIB
+#   include <zlib.h>
+#endif
 
 #ifdef _WIN32
 #   ifndef NOMINMAX
@@ -19,7 +39,15 @@
 #   endif
 #   include <Windows.h>
 #else
+#   include <fcntl.h>
+#   include <netdb.h>
+#   include <poll.h>
+#   include <signal.h>
 #   include <sys/ioctl.h>
+#   include <sys/mman.h>
+#   include <sys/socket.h>
+#   include <sys/stat.h>
+#   include <sys/un.h>
 #   include <unistd.h>
 #endif
 
@@ -31,6 +59,51 @@ namespace tlog {
     // No need to be beyond microseconds accuracy
     using duration_t = std::chrono::microseconds;
 
+    namespace detail {
+        // Writes the decimal digits of `value` such that they end right before `end`. Returns the first digit.
+        inline char* formatDecimal(char* end, unsigned long long value) {
+            static const char DIGIT_PAIRS[] =
+                "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+            while (value >= 100) {
+                size_t i = (size_t)(value % 100) * 2;
+                value /= 100;
+                *--end = DIGIT_PAIRS[i + 1];
+                *--end = DIGIT_PAIRS[i];
+            }
+
+            if (value >= 10) {
+                size_t i = (size_t)value * 2;
+                *--end = DIGIT_PAIRS[i + 1];
+                *--end = DIGIT_PAIRS[i];
+            } else {
+                *--end = (char)('0' + value);
+            }
+
+            return end;
+        }
+
+        inline void localTime(time_t time, std::tm& result) {
+#ifdef _WIN32
+            if (localtime_s(&result, &time) != 0) {
+#else
+            if (!localtime_r(&time, &result)) {
+#endif
+                throw std::runtime_error{"Could not render local time."};
+            }
+        }
+
+        inline void utcTime(time_t time, std::tm& result) {
+#ifdef _WIN32
+            if (gmtime_s(&result, &time) != 0) {
+#else
+            if (!gmtime_r(&time, &result)) {
+#endif
+                throw std::runtime_error{"Could not render UTC time."};
+            }
+        }
+    }
+
     inline std::string padFromLeft(std::string str, size_t length, const char paddingChar = ' ') {
         if (length > str.size()) {
             str.insert(0, length - str.size(), paddingChar);
@@ -46,8 +119,11 @@ namespace tlog {
     }
 
     inline std::string timeToString(const std::string& fmt, time_t time) {
+        std::tm localTime;
+        detail::localTime(time, localTime);
+
         char timeStr[128];
-        if (std::strftime(timeStr, 128, fmt.c_str(), localtime(&time)) == 0) {
+        if (std::strftime(timeStr, 128, fmt.c_str(), &localTime) == 0) {
             throw std::runtime_error{"Could not render local time."};
         }
 
@@ -58,8 +134,166 @@ namespace tlog {
         return timeToString(fmt, std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
     }
 
+    enum class ETimePrecision {
+        Seconds,
+        Milliseconds,
+        Microseconds,
+        Nanoseconds,
+    };
+
+    // Renders HH:MM:SS timestamps with optional fractional digits. localtime() and strftime()
+    // only run when the second changes; the fractional digits are patched in directly.
+    class TimestampCache {
+    public:
+        TimestampCache(ETimePrecision precision = ETimePrecision::Seconds) {
+            setPrecision(precision);
+        }
+
+        void append(std::string& str, std::chrono::system_clock::time_point time) {
+            using namespace std::chrono;
+
+            long long ns = duration_cast<nanoseconds>(time.time_since_epoch()).count();
+            long long second = ns / 1000000000;
+            long long fraction = ns % 1000000000;
+            if (fraction < 0) {
+                fraction += 1000000000;
+                second -= 1;
+            }
+
+            if (second != mCachedSecond) {
+                std::tm localTime;
+                detail::localTime((time_t)second, localTime);
+                if (std::strftime(mBuffer, sizeof(mBuffer), "%H:%M:%S", &localTime) != 8) {
+                    throw std::runtime_error{"Could not render local time."};
+                }
+                mBuffer[8] = '.'; // Overwrites strftime's null terminator
+                mCachedSecond = second;
+            }
+
+            if (mNumFractionalDigits > 0) {
+                // Zero-padded fraction, truncated to the requested number of digits.
+                char* end = mBuffer + length();
+                for (int i = mNumFractionalDigits; i < 9; ++i) {
+                    fraction /= 10;
+                }
+                char* begin = detail::formatDecimal(end, (unsigned long long)fraction);
+                while (begin > mBuffer + 9) {
+                    *--begin = '0';
+                }
+            }
+
+            str.append(mBuffer, length());
+        }
+
+        void setPrecision(ETimePrecision precision) {
+            mPrecision = precision;
+            switch (precision) {
+                case ETimePrecision::Seconds:      mNumFractionalDigits = 0; break;
+                case ETimePrecision::Milliseconds: mNumFractionalDigits = 3; break;
+                case ETimePrecision::Microseconds: mNumFractionalDigits = 6; break;
+                case ETimePrecision::Nanoseconds:  mNumFractionalDigits = 9; break;
+            }
+        }
+
+        ETimePrecision precision() const { return mPrecision; }
+
+        // Number of characters of each timestamp
+        size_t length() const { return 8 + (mNumFractionalDigits > 0 ? 1 + mNumFractionalDigits : 0); }
+
+    private:
+        ETimePrecision mPrecision;
+        int mNumFractionalDigits;
+        long long mCachedSecond = -1;
+        char mBuffer[32];
+    };
+
+    // Renders RFC 3339 timestamps in UTC with microseconds, e.g. 2026-10-14T03:55:24.123456Z, for
+    // outputs read by machines. Like TimestampCache, strftime() only runs when the second changes.
+    class UtcTimestampCache {
+    public:
+        void append(std::string& str, std::chrono::system_clock::time_point time) {
+            using namespace std::chrono;
+
+            long long us = duration_cast<microseconds>(time.time_since_epoch()).count();
+            long long second = us / 1000000;
+            long long fraction = us % 1000000;
+            if (fraction < 0) {
+                fraction += 1000000;
+                second -= 1;
+            }
+
+            if (second != mCachedSecond) {
+                std::tm utcTime;
+                detail::utcTime((time_t)second, utcTime);
+                if (std::strftime(mBuffer, sizeof(mBuffer), "%Y-%m-%dT%H:%M:%S.", &utcTime) != 20) {
+                    throw std::runtime_error{"Could not render UTC time."};
+                }
+                mCachedSecond = second;
+            }
+
+            char* end = mBuffer + 26;
+            char* begin = detail::formatDecimal(end, (unsigned long long)fraction);
+            while (begin > mBuffer + 20) {
+                *--begin = '0';
+            }
+            mBuffer[26] = 'Z';
+
+            str.append(mBuffer, 27);
+        }
+
+    private:
+        long long mCachedSecond = -1;
+        char mBuffer[32];
+    };
+
+    namespace detail {
+        // Writes the decimal digits of `value` at `out`. Returns the end.
+        inline char* writeDecimal(char* out, long long value) {
+            char digits[24];
+            char* end = digits + sizeof(digits);
+            char* begin = formatDecimal(end, value < 0 ? 0 - (unsigned long long)value : (unsigned long long)value);
+            if (value < 0) {
+                *--begin = '-';
+            }
+            std::memcpy(out, begin, (size_t)(end - begin));
+            return out + (end - begin);
+        }
+
+        inline char* writeDecimal(char* out, unsigned long long value) {
+            char digits[24];
+            char* end = digits + sizeof(digits);
+            char* begin = formatDecimal(end, value);
+            std::memcpy(out, begin, (size_t)(end - begin));
+            return out + (end - begin);
+        }
+
+        // Like padFromLeft(), but pads [begin, end) in place. Returns the new end.
+        inline char* padInPlace(char* begin, char* end, size_t length, char paddingChar = ' ') {
+            size_t size = (size_t)(end - begin);
+            if (length > size) {
+                std::memmove(begin + (length - size), begin, size);
+                std::memset(begin, paddingChar, length - size);
+                return begin + length;
+            }
+            return end;
+        }
+
+        // value * scale / total, rounded to the nearest integer, without overflowing for large values.
+        inline uint64_t scaleRounded(uint64_t value, uint64_t scale, uint64_t total) {
+            if (scale == 0 || value <= (~(uint64_t)0 - total / 2) / scale) {
+                return (value * scale + total / 2) / total;
+            }
+            return (uint64_t)std::round((double)value / total * scale);
+        }
+    }
+
+    // Longest result of durationToChars(): the days of a 64 bit count and "23h59m59s".
+    const size_t MAX_DURATION_CHARS = 32;
+
+    // Writes what durationToString() returns into `buffer`, which must hold MAX_DURATION_CHARS
+    // characters, without allocating. Returns the number of characters written.
     template <typename T>
-    std::string durationToString(T dur) {
+    size_t durationToChars(char* buffer, T dur) {
         using namespace std::chrono;
         using day_t = duration<long long, std::ratio<3600 * 24>>;
 
@@ -68,27 +302,36 @@ namespace tlog {
         auto m = duration_cast<minutes>(dur -= h);
         auto s = duration_cast<seconds>(dur -= m);
 
-        if (d.count() > 0) {
-            return
-                std::to_string(d.count()) + 'd' +
-                padFromLeft(std::to_string(h.count()), 2, '0') + 'h' +
-                padFromLeft(std::to_string(m.count()), 2, '0') + 'm' +
-                padFromLeft(std::to_string(s.count()), 2, '0') + 's';
-        } else if (h.count() > 0) {
-            return
-                std::to_string(h.count()) + 'h' +
-                padFromLeft(std::to_string(m.count()), 2, '0') + 'm' +
-                padFromLeft(std::to_string(s.count()), 2, '0') + 's';
-        } else if (m.count() > 0) {
-            return
-                std::to_string(m.count()) + 'm' +
-                padFromLeft(std::to_string(s.count()), 2, '0') + 's';
-        } else {
-            return std::to_string(s.count()) + 's';
+        // Leading units are skipped while they are zero; the ones after the first are padded to two digits.
+        const long long parts[] = {(long long)d.count(), (long long)h.count(), (long long)m.count(), (long long)s.count()};
+        const char units[] = {'d', 'h', 'm', 's'};
+
+        char* out = buffer;
+        bool isLeading = true;
+        for (int i = 0; i < 4; ++i) {
+            if (isLeading && i < 3 && parts[i] <= 0) {
+                continue;
+            }
+
+            char* begin = out;
+            out = detail::writeDecimal(out, parts[i]);
+            if (!isLeading) {
+                out = detail::padInPlace(begin, out, 2, '0');
+            }
+            *out++ = units[i];
+            isLeading = false;
         }
+
+        return (size_t)(out - buffer);
     }
 
-    inline std::string progressBar(uint64_t current, uint64_t total, duration_t duration, int width) {
+    template <typename T>
+    std::string durationToString(T dur) {
+        char buffer[MAX_DURATION_CHARS];
+        return std::string(buffer, durationToChars(buffer, dur));
+    }
+
+    inline void checkProgress(uint64_t current, uint64_t total) {
         if (total == 0) {
             throw std::invalid_argument{"Progress: total must not be zero."};
         }
@@ -96,56 +339,106 @@ namespace tlog {
         if (current > total) {
             throw std::invalid_argument{"Progress: current must not be larger than total"};
         }
+    }
 
-        double fraction = (double)current / total;
+    // Longest text that progressBar() puts after the bar: percentage, fraction and time.
+    const size_t MAX_PROGRESS_LABEL_SIZE = 4 + 2 + 41 + 2 + 2 * MAX_DURATION_CHARS + 1;
+
+    // Renders the progress bar into `buffer` without allocating and returns its length. The result
+    // is cut off after `size` characters; `width` plus MAX_PROGRESS_LABEL_SIZE always fit.
+    inline size_t progressBar(char* buffer, size_t size, uint64_t current, uint64_t total, duration_t duration, int width) {
+        checkProgress(current, total);
+
+        char label[MAX_PROGRESS_LABEL_SIZE];
+        char* out = label;
 
         // Percentage display. Looks like so:
         //  69%
-        int percentage = (int)std::round(fraction * 100);
-        std::string percentageStr = padFromLeft(std::to_string(percentage) + "%", 4);
+        char* begin = out;
+        out = detail::writeDecimal(out, (unsigned long long)detail::scaleRounded(current, 100, total));
+        *out++ = '%';
+        out = detail::padInPlace(begin, out, 4);
 
         // Fraction display. Looks like so:
         // ( 123/1337)
-        std::string totalStr = std::to_string(total);
-        std::string fractionStr = padFromLeft(std::to_string(current) + "/" + totalStr, totalStr.size() * 2 + 1);
+        *out++ = ' ';
+        *out++ = '(';
+        begin = out;
+        out = detail::writeDecimal(out, (unsigned long long)current);
+        *out++ = '/';
+        char* totalBegin = out;
+        out = detail::writeDecimal(out, (unsigned long long)total);
+        out = detail::padInPlace(begin, out, (size_t)(out - totalBegin) * 2 + 1);
+        *out++ = ')';
+        *out++ = ' ';
 
         // Time display. Looks like so:
         //     3s/17m03s
-        std::string projectedDurationStr;
+        char projected[MAX_DURATION_CHARS];
+        size_t projectedSize;
         if (current == 0) {
-            projectedDurationStr = "inf";
+            std::memcpy(projected, "inf", 3);
+            projectedSize = 3;
         } else {
-            auto projectedDuration = duration * (1 / fraction);
-            projectedDurationStr = durationToString(projectedDuration);
+            // In floating point, such that projections that overflow the integer microseconds still render.
+            projectedSize = durationToChars(projected, duration * (1 / ((double)current / total)));
         }
-        std::string timeStr = padFromLeft(durationToString(duration) + "/" + projectedDurationStr, projectedDurationStr.size() * 2 + 1);
 
-        // Put the label together. Looks like so:
-        //  69% ( 123/1337)     3s/17m03s
-        std::string label = percentageStr + " (" + fractionStr + ") " + timeStr;
+        begin = out;
+        out += durationToChars(out, duration);
+        *out++ = '/';
+        std::memcpy(out, projected, projectedSize);
+        out += projectedSize;
+        out = detail::padInPlace(begin, out, projectedSize * 2 + 1);
+
+        size_t labelSize = (size_t)(out - label);
 
         // Build the progress bar itself. Looks like so:
         // [=================>                         ]
-        int usableWidth = std::max(0, width
+        size_t usableWidth = (size_t)std::max(0, width
             - 2 // The surrounding [ and ]
             - 1 // Space between progress bar and label
-            - (int)label.size() // Label itself
+            - (int)labelSize // Label itself
         );
+        size_t numFilledChars = (size_t)detail::scaleRounded(current, usableWidth, total);
 
-        int numFilledChars = (int)std::round(usableWidth * fraction);
+        // Put everything together. Looks like so:
+        // [=================>                         ]  69% ( 123/1337)     3s/17m03s
+        size_t pos = 0;
+        auto append = [&](const char* data, size_t n) {
+            n = std::min(n, size - pos);
+            std::memcpy(buffer + pos, data, n);
+            pos += n;
+        };
+        auto fill = [&](char c, size_t n) {
+            n = std::min(n, size - pos);
+            std::memset(buffer + pos, c, n);
+            pos += n;
+        };
 
-        std::string body(usableWidth, ' ');
-        if (numFilledChars > 0) {
-            for (int i = 0; i < numFilledChars; ++i)
-                body[i] = '=';
-            if (numFilledChars < usableWidth) {
-                body[numFilledChars] = '>';
-            }
+        fill('[', 1);
+        fill('=', numFilledChars);
+        if (numFilledChars > 0 && numFilledChars < usableWidth) {
+            fill('>', 1);
+            ++numFilledChars;
         }
+        fill(' ', usableWidth - numFilledChars);
+        append("] ", 2);
+        append(label, labelSize);
+        return pos;
+    }
 
-        // Put everything together. Looks like so:
-        // [=================>                         ]  69% ( 123/1337)     3s/17m03s
-        return std::string{"["} + body + "] " + label;
+    // Appends the progress bar to `textOut`, whose capacity outputs reuse across updates.
+    inline void appendProgressBar(std::string& textOut, uint64_t current, uint64_t total, duration_t duration, int width) {
+        size_t start = textOut.size();
+        textOut.resize(start + (size_t)std::max(0, width) + MAX_PROGRESS_LABEL_SIZE);
+        textOut.resize(start + progressBar(&textOut[start], textOut.size() - start, current, total, duration, width));
+    }
+
+    inline std::string progressBar(uint64_t current, uint64_t total, duration_t duration, int width) {
+        std::string result;
+        appendProgressBar(result, current, total, duration, width);
+        return result;
     }
 
     enum class ESeverity {
@@ -158,296 +451,6313 @@ namespace tlog {
         Progress,
     };
 
-    inline std::string severityToString(ESeverity severity) {
-        switch (severity) {
-            case ESeverity::Success:  return "SUCCESS";
-            case ESeverity::Info:     return "INFO";
-            case ESeverity::Warning:  return "WARNING";
-            case ESeverity::Debug:    return "DEBUG";
-            case ESeverity::Error:    return "ERROR";
-            case ESeverity::Progress: return "PROGRESS";
-            default:                  return "";
-        };
+    inline constexpr uint32_t severityMask(ESeverity severity) {
+        return 1u << (uint32_t)severity;
     }
 
-    class IOutput {
-    public:
-        virtual void writeLine(const std::string& scope, ESeverity severity, const std::string& line) = 0;
-        virtual void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) = 0;
-    };
-
-
-      ///////////////////////////////
-     /// IOutput implementations ///
-    ///////////////////////////////
-
-    namespace ansi {
-        const std::string ESC = "\033";
-
-        const std::string RESET = ESC + "[0m";
-        const std::string LINE_BEGIN = ESC + "[0G";
-        const std::string ERASE_TO_END_OF_LINE = ESC + "[K";
+    const uint32_t ALL_SEVERITIES = ~0u;
 
-        const std::string BLACK   = ESC + "[0;30m";
-        const std::string RED     = ESC + "[0;31m";
-        const std::string GREEN   = ESC + "[0;32m";
-        const std::string YELLOW  = ESC + "[0;33m";
-        const std::string BLUE    = ESC + "[0;34m";
-        const std::string MAGENTA = ESC + "[0;35m";
-        const std::string CYAN    = ESC + "[0;36m";
-        const std::string WHITE   = ESC + "[0;37m";
+    namespace detail {
+        inline const char* severityName(ESeverity severity) {
+            switch (severity) {
+                case ESeverity::Success:  return "SUCCESS";
+                case ESeverity::Info:     return "INFO";
+                case ESeverity::Warning:  return "WARNING";
+                case ESeverity::Debug:    return "DEBUG";
+                case ESeverity::Error:    return "ERROR";
+                case ESeverity::Progress: return "PROGRESS";
+                default:                  return "";
+            };
+        }
 
-        const std::string BOLD_BLACK   = ESC + "[1;30m";
-        const std::string BOLD_RED     = ESC + "[1;31m";
-        const std::string BOLD_GREEN   = ESC + "[1;32m";
-        const std::string BOLD_YELLOW  = ESC + "[1;33m";
-        const std::string BOLD_BLUE    = ESC + "[1;34m";
-        const std::string BOLD_MAGENTA = ESC + "[1;35m";
-        const std::string BOLD_CYAN    = ESC + "[1;36m";
-        const std::string BOLD_WHITE   = ESC + "[1;37m";
+        // As used by structured outputs, e.g. "warning".
+        inline const char* severityLevel(ESeverity severity) {
+            switch (severity) {
+                case ESeverity::Success:  return "success";
+                case ESeverity::Info:     return "info";
+                case ESeverity::Warning:  return "warning";
+                case ESeverity::Debug:    return "debug";
+                case ESeverity::Error:    return "error";
+                case ESeverity::Progress: return "progress";
+                default:                  return "none";
+            };
+        }
+    }
 
-        const std::string HIDE_CURSOR = ESC + "[?25l";
-        const std::string SHOW_CURSOR = ESC + "[?25h";
+    inline std::string severityToString(ESeverity severity) {
+        return detail::severityName(severity);
     }
 
-    class ConsoleOutput : public IOutput {
-    public:
-        virtual ~ConsoleOutput() {
-            if (mSupportsAnsiControlSequences) {
-                std::cout << ansi::RESET;
+    namespace detail {
+        // Runs periodic tasks, such as timed flushes, on a single background thread that is
+        // started on first use.
+        class Scheduler {
+        public:
+            // Never destroyed, so that outputs with static storage duration can still unregister
+            // their tasks while the program exits.
+            static Scheduler& global() {
+                static auto scheduler = new Scheduler{};
+                return *scheduler;
             }
-        }
 
-        static std::shared_ptr<ConsoleOutput>& global() {
-            static auto consoleOutput = std::shared_ptr<ConsoleOutput>(new ConsoleOutput());
-            return consoleOutput;
-        }
+            uint64_t add(std::chrono::milliseconds interval, std::function<void()> task) {
+                std::lock_guard<std::mutex> lock{mMutex};
+                if (!mThread.joinable()) {
+                    mThread = std::thread{[this]() { run(); }};
+                }
 
-        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
-            std::string textOut;
-            if (severity != ESeverity::None) {
-                textOut += nowToString("%H:%M:%S ");
+                uint64_t id = mNextId++;
+                mTasks.push_back({id, interval, std::chrono::steady_clock::now() + interval, std::move(task)});
+                mCv.notify_all();
+                return id;
             }
 
-            // Color for severities
-            if (mSupportsAnsiControlSequences) {
-                switch (severity) {
-                    case ESeverity::Success:  textOut += ansi::GREEN;       break;
-                    case ESeverity::Info:     textOut += ansi::CYAN;        break;
-                    case ESeverity::Warning:  textOut += ansi::BOLD_YELLOW; break;
-                    case ESeverity::Debug:    textOut += ansi::MAGENTA;     break;
-                    case ESeverity::Error:    textOut += ansi::BOLD_RED;    break;
-                    case ESeverity::Progress: textOut += ansi::BLUE;        break;
-                    default:                                                break;
+            // Once this returns, the task is guaranteed to not be running anymore.
+            void remove(uint64_t id) {
+                std::unique_lock<std::mutex> lock{mMutex};
+                mTasks.erase(std::remove_if(mTasks.begin(), mTasks.end(), [id](const Task& task) { return task.id == id; }), mTasks.end());
+                if (std::this_thread::get_id() != mThread.get_id()) {
+                    mCv.wait(lock, [&]() { return mRunningId != id; });
                 }
             }
 
-            auto severityStr = severityToString(severity);
-            if (severity != ESeverity::None) {
-                severityStr = padFromRight(severityStr, 9);
-            }
-            textOut += severityStr;
+        private:
+            struct Task {
+                uint64_t id;
+                std::chrono::milliseconds interval;
+                std::chrono::steady_clock::time_point due;
+                std::function<void()> function;
+            };
 
-            if (!scope.empty()) {
-                if (mSupportsAnsiControlSequences) {
-                    textOut += ansi::BOLD_WHITE;
-                }
+            Scheduler() = default;
 
-                textOut += std::string{'['} + scope + "] ";
-            }
+            void run() {
+                std::unique_lock<std::mutex> lock{mMutex};
+                for (;;) {
+                    if (mTasks.empty()) {
+                        mCv.wait(lock);
+                        continue;
+                    }
 
-            if (mSupportsAnsiControlSequences && severity != ESeverity::None) {
-                textOut += ansi::RESET;
-            }
+                    auto next = std::min_element(mTasks.begin(), mTasks.end(), [](const Task& a, const Task& b) { return a.due < b.due; });
+                    auto now = std::chrono::steady_clock::now();
+                    if (next->due > now) {
+                        mCv.wait_until(lock, next->due);
+                        continue;
+                    }
 
-            textOut += line;
+                    next->due = now + next->interval;
+                    mRunningId = next->id;
+                    auto function = next->function;
 
-            if (mSupportsAnsiControlSequences) {
-                textOut += ansi::ERASE_TO_END_OF_LINE + ansi::RESET;
-            }
+                    lock.unlock();
+                    try {
+                        function();
+                    } catch (...) {}
+                    lock.lock();
 
-            // Make sure there is a linebreak in the end. We don't want duplicates!
-            if (mSupportsAnsiControlSequences && severity == ESeverity::Progress) {
-                textOut += ansi::LINE_BEGIN;
-            } else {
-                textOut += '\n';
+                    mRunningId = 0;
+                    mCv.notify_all();
+                }
             }
 
-            auto& stream = severity == ESeverity::Warning || severity == ESeverity::Error ? std::cerr : std::cout;
-            stream << textOut << std::flush;
-        }
+            std::mutex mMutex;
+            std::condition_variable mCv;
+            std::vector<Task> mTasks;
+            uint64_t mNextId = 1;
+            uint64_t mRunningId = 0;
+            std::thread mThread;
+        };
 
-        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
-            int progressBarWidth = consoleWidth() - 18; // 18 is the width of the time string and severity
+        // Registers a function with the global scheduler for as long as it is alive.
+        class PeriodicTask {
+        public:
+            PeriodicTask() = default;
+            PeriodicTask(const PeriodicTask&) = delete;
+            PeriodicTask& operator=(const PeriodicTask&) = delete;
 
-            if (!scope.empty()) {
-                progressBarWidth -= 3 + (int)scope.size();
+            ~PeriodicTask() {
+                stop();
             }
 
-// Due to a bug in windows' ANSI sequence handling the last character of the line is erased
-// if a clear-to-end-of-line is issued while the cursor is after the last character of a line
-// (i.e. if the control character would be on a new line if it was a regular character).
-#ifdef _WIN32
-            if (mSupportsAnsiControlSequences) {
-                progressBarWidth -= 1;
+            void start(std::chrono::milliseconds interval, std::function<void()> function) {
+                stop();
+                mId = Scheduler::global().add(interval, std::move(function));
             }
-#endif
 
-            progressBarWidth = std::max(0, progressBarWidth);
+            void stop() {
+                if (mId != 0) {
+                    Scheduler::global().remove(mId);
+                    mId = 0;
+                }
+            }
 
-            writeLine(scope, ESeverity::Progress, progressBar(current, total, duration, progressBarWidth));
-        }
+        private:
+            uint64_t mId = 0;
+        };
+    }
 
-    private:
-        ConsoleOutput() {
-            mSupportsAnsiControlSequences = enableAnsiControlSequences();
-            if (mSupportsAnsiControlSequences) {
-                std::cout << ansi::RESET;
-            }
-        }
+    // Decides when outputs hand their buffered text to the operating system. Text is flushed as
+    // soon as any of the conditions holds; a buffer size of zero disables buffering altogether.
+    struct FlushPolicy {
+        // Severities whose records are flushed right away, as a bitmask of severityMask() values
+        uint32_t severities;
+        // Flush once this many bytes are buffered
+        size_t bufferSize;
+        // Flush once this many records are buffered. Zero disables the limit.
+        size_t maxRecords;
+        // Flush buffered text at least this often. Zero disables the timer.
+        std::chrono::milliseconds interval;
 
-        static bool enableAnsiControlSequences() {
-            char* noColorEnv = getenv("NO_COLOR");
-            if (noColorEnv && noColorEnv[0] != '\0') {
-                return false;
-            }
+        static FlushPolicy always() {
+            return {ALL_SEVERITIES, 0, 0, std::chrono::milliseconds{0}};
+        }
 
-#ifdef _WIN32
-            // Set output mode to handle virtual terminal sequences
-            HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
-            if (hOut == INVALID_HANDLE_VALUE) {
-                return false;
-            }
-            DWORD dwMode = 0;
-            if (!GetConsoleMode(hOut, &dwMode)) {
-                return false;
-            }
-            dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
-            if (!SetConsoleMode(hOut, dwMode)) {
-                return false;
-            }
-#endif
-            return true;
+        static FlushPolicy buffered(size_t bufferSize = 64 * 1024, std::chrono::milliseconds interval = std::chrono::milliseconds{0}) {
+            return {0, bufferSize, 0, interval};
         }
 
-        static int consoleWidth() {
-#ifdef _WIN32
-            CONSOLE_SCREEN_BUFFER_INFO csbi;
-            GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
-            return csbi.srWindow.Right - csbi.srWindow.Left + 1;
-#else
-            winsize size;
-            ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
-            return size.ws_col;
-#endif
+        // Flushes warnings and errors right away and everything else once the buffer is full or the interval passed.
+        static FlushPolicy onSeverity(
+            uint32_t severities = severityMask(ESeverity::Warning) | severityMask(ESeverity::Error),
+            size_t bufferSize = 64 * 1024,
+            std::chrono::milliseconds interval = std::chrono::milliseconds{1000}
+        ) {
+            return {severities, bufferSize, 0, interval};
         }
 
-        bool mSupportsAnsiControlSequences;
+        static FlushPolicy everyRecords(size_t maxRecords, size_t bufferSize = 64 * 1024) {
+            return {0, bufferSize, maxRecords, std::chrono::milliseconds{0}};
+        }
     };
 
-    class FileOutput : public IOutput {
-    public:
-        FileOutput(const char* filename) : mFile{filename} {}
-        FileOutput(const std::string& filename) : mFile{filename} {}
-#ifdef _WIN32
-        FileOutput(const std::wstring& filename) : mFile{filename} {}
-#endif
-
-// GCC <5 has a buggy std implementation where ostream does not have
-// a move constructor even though it should according to C++11 spec.
-#if !defined(__GNUC__) || __GNUC__ >= 5
-        FileOutput(std::ofstream&& file) : mFile{std::move(file)} {}
-#endif
+    namespace detail {
+        // Text that an output has formatted but not yet written, along with what is needed
+        // to evaluate its FlushPolicy.
+        struct PendingText {
+            std::string text;
+            size_t numRecords = 0;
+            bool urgent = false;
+            std::chrono::steady_clock::time_point lastFlush = std::chrono::steady_clock::now();
 
-        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
-            std::string textOut;
-            if (severity != ESeverity::None) {
-                textOut += nowToString("%H:%M:%S ");
+            void add(ESeverity severity, const FlushPolicy& policy) {
+                ++numRecords;
+                if (policy.severities & severityMask(severity)) {
+                    urgent = true;
+                }
             }
 
-            if (!scope.empty()) {
-                textOut += std::string{'['} + scope + "] ";
+            bool isDue(const FlushPolicy& policy) const {
+                return
+                    urgent ||
+                    text.size() >= policy.bufferSize ||
+                    (policy.maxRecords > 0 && numRecords >= policy.maxRecords) ||
+                    (policy.interval.count() > 0 && std::chrono::steady_clock::now() - lastFlush >= policy.interval);
             }
 
-            textOut += severityToString(severity);
-            if (severity != ESeverity::None) {
-                textOut += ' ';
+            void reset() {
+                text.clear();
+                numRecords = 0;
+                urgent = false;
+                lastFlush = std::chrono::steady_clock::now();
             }
+        };
 
-            textOut += line + '\n';
-            mFile << textOut;
-        }
+        // The part of a line between its timestamp and its text only depends on the scope and the
+        // severity. Outputs render it once per pair and keep it here. Loggers usually log repeatedly with
+        // the same scope, so the previous scope is compared first, before looking up any other.
+        class PrefixCache {
+        public:
+            // Calls `render(prefix, scope, severity)` the first time a pair is needed.
+            template <typename F>
+            const std::string& get(const std::string& scope, ESeverity severity, F&& render) {
+                if (!mLast || *mLastScope != scope) {
+                    if (mEntries.size() >= MAX_SCOPES) {
+                        clear();
+                    }
 
-        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
-            writeLine(scope, ESeverity::Progress, progressBar(current, total, duration, 80));
-        }
+                    auto it = mEntries.insert(std::make_pair(scope, Entry{})).first;
+                    mLastScope = &it->first;
+                    mLast = &it->second;
+                }
+
+                size_t index = (size_t)severity;
+                if (!mLast->rendered[index]) {
+                    render(mLast->prefixes[index], scope, severity);
+                    mLast->rendered[index] = true;
+                }
+                return mLast->prefixes[index];
+            }
+
+            // Does not allocate. Returns nullptr for pairs that were not rendered yet.
+            const std::string* find(const std::string& scope, ESeverity severity) const {
+                auto it = mEntries.find(scope);
+                if (it == mEntries.end() || !it->second.rendered[(size_t)severity]) {
+                    return nullptr;
+                }
+                return &it->second.prefixes[(size_t)severity];
+            }
+
+            void clear() {
+                mEntries.clear();
+                mLastScope = nullptr;
+                mLast = nullptr;
+            }
+
+        private:
+            static const size_t NUM_SEVERITIES = (size_t)ESeverity::Progress + 1;
+
+            // Logs with ever-changing scopes must not grow the cache indefinitely.
+            static const size_t MAX_SCOPES = 256;
+
+            struct Entry {
+                std::string prefixes[NUM_SEVERITIES];
+                bool rendered[NUM_SEVERITIES] = {};
+            };
+
+            std::map<std::string, Entry> mEntries;
+            const std::string* mLastScope = nullptr;
+            Entry* mLast = nullptr;
+        };
+    }
+
+    // A single line on its way to the outputs. It merely refers to memory owned by the
+    // caller, so outputs must copy whatever they want to keep beyond the call.
+    namespace detail {
+        // Small number that identifies the calling thread, counting up from zero.
+        inline unsigned threadIndex() {
+            static std::atomic<unsigned> numThreads{0};
+            static thread_local unsigned index = numThreads++;
+            return index;
+        }
+    }
+
+    enum class EFieldType {
+        String,
+        // Integers and finite floating point numbers
+        Number,
+        Bool,
+    };
+
+    // A key-value pair attached to a record, see BasicStream::kv(). The value is already rendered.
+    struct Field {
+        EFieldType type;
+        const char* key;
+        size_t keySize;
+        const char* value;
+        size_t valueSize;
+    };
+
+    // The fields of a record, encoded back to back into a single buffer: per field its type, then its
+    // key and its value, each preceded by its size as a 32 bit integer.
+    struct Fields {
+        const char* data;
+        size_t size;
+
+        bool empty() const { return size == 0; }
+
+        template <typename F>
+        void forEach(F&& f) const {
+            const char* pos = data;
+            const char* end = data + size;
+            while (pos < end) {
+                Field field;
+                field.type = (EFieldType)*pos++;
+
+                uint32_t size32;
+                std::memcpy(&size32, pos, 4);
+                field.key = pos + 4;
+                field.keySize = size32;
+                pos += 4 + size32;
+
+                std::memcpy(&size32, pos, 4);
+                field.value = pos + 4;
+                field.valueSize = size32;
+                pos += 4 + size32;
+
+                f(field);
+            }
+        }
+    };
+
+    struct Record {
+        ESeverity severity;
+        const std::string* scope;
+        const char* text;
+        size_t size;
+        // Taken once by the logger, such that all outputs agree on it.
+        std::chrono::system_clock::time_point time;
+        // The logging thread, see detail::threadIndex(). Zero for records decoded from files.
+        unsigned thread;
+        // Empty for most records.
+        Fields fields;
+    };
+
+    // A record whose text is only rendered when an output needs it, see Logger::logDeferred().
+    struct DeferredRecord {
+        ESeverity severity;
+        const std::string* scope;
+        // Appends the text. Outputs that render later, possibly on another thread, keep a copy.
+        const std::function<void(std::string&)>* render;
+        std::chrono::system_clock::time_point time;
+        unsigned thread;
+    };
+
+      ///////////////////////////////////////////
+     /// Binary records with deferred format ///
+    ///////////////////////////////////////////
+
+    // The static part of a binary log call: its format string, source location and severity. Every
+    // call site creates one of these once (see TLOG_BINARY), so records only need to carry its id.
+    // The format string refers to arguments with `{}`, and `{{` and `}}` produce literal braces.
+    class EventFormat {
+    public:
+        EventFormat(ESeverity severity, const char* file, uint32_t line, const char* format)
+        : mSeverity{severity}, mFile{file}, mLine{line}, mFormat{format}, mId{nextId()} {}
+
+        EventFormat(const EventFormat&) = delete;
+        EventFormat& operator=(const EventFormat&) = delete;
+
+        ESeverity severity() const { return mSeverity; }
+        const char* file() const { return mFile; }
+        uint32_t line() const { return mLine; }
+        const char* format() const { return mFormat; }
+
+        // Unique within the process, counting up from zero.
+        uint32_t id() const { return mId; }
+
+    private:
+        static uint32_t nextId() {
+            static std::atomic<uint32_t> id{0};
+            return id++;
+        }
+
+        ESeverity mSeverity;
+        const char* mFile;
+        uint32_t mLine;
+        const char* mFormat;
+        uint32_t mId;
+    };
+
+    // A binary log call on its way to the outputs. Like Record, it refers to memory owned by the caller.
+    struct BinaryRecord {
+        const EventFormat* format;
+        const std::string* scope;
+        // The encoded arguments, see detail::encodeArg().
+        const char* args;
+        size_t size;
+        std::chrono::system_clock::time_point time;
+        unsigned thread;
+    };
+
+    namespace detail {
+        inline void appendVarint(std::string& out, uint64_t value) {
+            while (value >= 0x80) {
+                out += (char)(value | 0x80);
+                value >>= 7;
+            }
+            out += (char)value;
+        }
+
+        inline bool readVarint(const char*& it, const char* end, uint64_t& value) {
+            value = 0;
+            for (int shift = 0; it != end && shift < 64; shift += 7) {
+                uint8_t byte = (uint8_t)*it++;
+                value |= (uint64_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        inline uint64_t zigzag(int64_t value) {
+            return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+        }
+
+        inline int64_t unzigzag(uint64_t value) {
+            return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+        }
+
+        inline void appendString(std::string& out, const char* str, size_t size) {
+            appendVarint(out, size);
+            out.append(str, size);
+        }
+
+        inline bool readString(const char*& it, const char* end, const char*& str, size_t& size) {
+            uint64_t length;
+            if (!readVarint(it, end, length) || length > (uint64_t)(end - it)) {
+                return false;
+            }
+            str = it;
+            size = (size_t)length;
+            it += length;
+            return true;
+        }
+
+        // Each argument is a type tag followed by its value. Integers are stored as varints and
+        // floats as the raw bytes of a double, in the byte order of the machine that logged them.
+        enum class EArgType : uint8_t {
+            Signed,
+            Unsigned,
+            Float,
+            String,
+            Bool,
+            Char,
+        };
+
+        inline void encodeSigned(std::string& out, long long value) {
+            out += (char)EArgType::Signed;
+            appendVarint(out, zigzag(value));
+        }
+
+        inline void encodeUnsigned(std::string& out, unsigned long long value) {
+            out += (char)EArgType::Unsigned;
+            appendVarint(out, value);
+        }
+
+        inline void encodeString(std::string& out, const char* str, size_t size) {
+            out += (char)EArgType::String;
+            appendString(out, str, size);
+        }
+
+        inline void encodeFloat(std::string& out, double value) {
+            out += (char)EArgType::Float;
+            char bytes[sizeof(double)];
+            std::memcpy(bytes, &value, sizeof(double));
+            out.append(bytes, sizeof(double));
+        }
+
+        // The overloads mirror the fast paths of Stream, so that both render identical text.
+        inline void encodeArg(std::string& out, int value)                { encodeSigned(out, value);   }
+        inline void encodeArg(std::string& out, long value)               { encodeSigned(out, value);   }
+        inline void encodeArg(std::string& out, long long value)          { encodeSigned(out, value);   }
+        inline void encodeArg(std::string& out, unsigned int value)       { encodeUnsigned(out, value); }
+        inline void encodeArg(std::string& out, unsigned long value)      { encodeUnsigned(out, value); }
+        inline void encodeArg(std::string& out, unsigned long long value) { encodeUnsigned(out, value); }
+
+        inline void encodeArg(std::string& out, float value)  { encodeFloat(out, value); }
+        inline void encodeArg(std::string& out, double value) { encodeFloat(out, value); }
+
+        inline void encodeArg(std::string& out, bool value) {
+            out += (char)EArgType::Bool;
+            out += (char)value;
+        }
+
+        inline void encodeArg(std::string& out, char value) {
+            out += (char)EArgType::Char;
+            out += value;
+        }
+
+        inline void encodeArg(std::string& out, const std::string& value) { encodeString(out, value.data(), value.size()); }
+        inline void encodeArg(std::string& out, const char* value) {
+            encodeString(out, value ? value : "", value ? std::strlen(value) : 0);
+        }
+
+        // Everything else, including long double, is turned into text right away.
+        template <typename T>
+        void encodeArg(std::string& out, const T& value) {
+            std::ostringstream stream;
+            stream << value;
+            std::string text = stream.str();
+            encodeString(out, text.data(), text.size());
+        }
+
+        inline void encodeArgs(std::string&) {}
+
+        template <typename T, typename... Args>
+        void encodeArgs(std::string& out, const T& value, const Args&... args) {
+            encodeArg(out, value);
+            encodeArgs(out, args...);
+        }
+
+        // Renders the next argument. Returns false if the arguments are malformed.
+        inline bool renderArg(std::string& out, const char*& it, const char* end) {
+            if (it == end) {
+                return false;
+            }
+
+            EArgType type = (EArgType)*it++;
+            uint64_t value;
+            char str[32];
+            switch (type) {
+                case EArgType::Signed: {
+                    if (!readVarint(it, end, value)) {
+                        return false;
+                    }
+                    int64_t signedValue = unzigzag(value);
+                    char* begin = formatDecimal(str + sizeof(str), signedValue < 0 ? 0 - (uint64_t)signedValue : (uint64_t)signedValue);
+                    if (signedValue < 0) {
+                        *--begin = '-';
+                    }
+                    out.append(begin, str + sizeof(str));
+                    return true;
+                }
+                case EArgType::Unsigned: {
+                    if (!readVarint(it, end, value)) {
+                        return false;
+                    }
+                    char* begin = formatDecimal(str + sizeof(str), value);
+                    out.append(begin, str + sizeof(str));
+                    return true;
+                }
+                case EArgType::Float: {
+                    double floatValue;
+                    if (end - it < (ptrdiff_t)sizeof(double)) {
+                        return false;
+                    }
+                    std::memcpy(&floatValue, it, sizeof(double));
+                    it += sizeof(double);
+                    int size = std::snprintf(str, sizeof(str), "%g", floatValue);
+                    if (size > 0) {
+                        out.append(str, std::min((size_t)size, sizeof(str) - 1));
+                    }
+                    return true;
+                }
+                case EArgType::String: {
+                    const char* text;
+                    size_t size;
+                    if (!readString(it, end, text, size)) {
+                        return false;
+                    }
+                    out.append(text, size);
+                    return true;
+                }
+                case EArgType::Bool:
+                    if (it == end) {
+                        return false;
+                    }
+                    out += *it++ ? '1' : '0';
+                    return true;
+                case EArgType::Char:
+                    if (it == end) {
+                        return false;
+                    }
+                    out += *it++;
+                    return true;
+            }
+
+            return false;
+        }
+
+        // Substitutes the encoded arguments into `format`. Placeholders without a matching argument
+        // are kept as they are. Returns false if the arguments are malformed.
+        inline bool renderBinary(std::string& out, const char* format, const char* args, size_t size) {
+            const char* end = args + size;
+            for (const char* c = format; *c; ++c) {
+                if ((c[0] == '{' && c[1] == '{') || (c[0] == '}' && c[1] == '}')) {
+                    out += *c++;
+                } else if (c[0] == '{' && c[1] == '}' && args != end) {
+                    if (!renderArg(out, args, end)) {
+                        return false;
+                    }
+                    ++c;
+                } else {
+                    out += *c;
+                }
+            }
+            return true;
+        }
+
+        // Borrows a per-thread string that keeps its capacity across uses. Borrows nest (e.g. a binary
+        // record that is rendered while its encoded arguments are borrowed), so every thread keeps a
+        // few strings; deeper borrows get a string of their own.
+        class ScratchString {
+        public:
+            ScratchString() : mSlot{depth()++} {
+                if (mSlot < NUM_STRINGS) {
+                    std::swap(mString, strings()[mSlot]);
+                    mString.clear();
+                }
+            }
+
+            ScratchString(const ScratchString&) = delete;
+            ScratchString& operator=(const ScratchString&) = delete;
+
+            ~ScratchString() {
+                --depth();
+                if (mSlot < NUM_STRINGS && mString.capacity() <= 64 * 1024) {
+                    std::swap(mString, strings()[mSlot]);
+                }
+            }
+
+            std::string& get() { return mString; }
+
+        private:
+            static const size_t NUM_STRINGS = 4;
+
+            static std::string* strings() {
+                static thread_local std::string strings[NUM_STRINGS];
+                return strings;
+            }
+
+            static size_t& depth() {
+                static thread_local size_t depth = 0;
+                return depth;
+            }
+
+            size_t mSlot;
+            std::string mString;
+        };
+    }
+
+      /////////////////////////////////////////
+     /// fmt-style formatting of log lines ///
+    /////////////////////////////////////////
+
+    // A value that is only computed if the record it is logged in is shown, e.g.
+    // `tlog::debug() << tlog::lazy([&]() { return dump(state); });`. Works with streams, kv() and the
+    // format functions, and is evaluated on the logging thread. See Logger::logDeferred() to move the
+    // work to the worker of an AsyncOutput instead.
+    template <typename F>
+    class Lazy {
+    public:
+        explicit Lazy(F f) : mF(std::move(f)) {}
+
+        auto operator()() const -> decltype(std::declval<const F&>()()) { return mF(); }
+
+    private:
+        F mF;
+    };
+
+    template <typename F>
+    Lazy<typename std::decay<F>::type> lazy(F&& f) {
+        return Lazy<typename std::decay<F>::type>{std::forward<F>(f)};
+    }
+
+    namespace detail {
+        // Number of `{}` placeholders in `format`, not counting the escapes `{{` and `}}`, or -1 if it
+        // contains a lone brace. Usable in constant expressions, see TLOG_FORMAT.
+        constexpr int countPlaceholders(const char* format, int count = 0) {
+            return
+                format[0] == '\0' ? count :
+                (format[0] == '{' && format[1] == '{') || (format[0] == '}' && format[1] == '}') ? countPlaceholders(format + 2, count) :
+                format[0] == '{' && format[1] == '}' ? countPlaceholders(format + 2, count + 1) :
+                format[0] == '{' || format[0] == '}' ? -1 :
+                countPlaceholders(format + 1, count);
+        }
+
+        // Only used in unevaluated contexts, to count macro arguments without evaluating them.
+        template <typename... Args>
+        std::integral_constant<int, (int)sizeof...(Args)> countArgs(const Args&...);
+
+        // The conversions match the fast paths of Stream.
+        inline void appendSigned(std::string& out, long long value) {
+            char str[24];
+            char* end = str + sizeof(str);
+            char* begin = formatDecimal(end, value < 0 ? 0 - (unsigned long long)value : (unsigned long long)value);
+            if (value < 0) {
+                *--begin = '-';
+            }
+            out.append(begin, end);
+        }
+
+        inline void appendUnsigned(std::string& out, unsigned long long value) {
+            char str[24];
+            char* end = str + sizeof(str);
+            out.append(formatDecimal(end, value), end);
+        }
+
+        template <typename T>
+        void appendFloat(std::string& out, const char* format, T value) {
+            char str[64];
+            int size = std::snprintf(str, sizeof(str), format, value);
+            if (size > 0) {
+                out.append(str, std::min((size_t)size, sizeof(str) - 1));
+            }
+        }
+
+        inline void appendValue(std::string& out, int value)                { appendSigned(out, value);   }
+        inline void appendValue(std::string& out, long value)               { appendSigned(out, value);   }
+        inline void appendValue(std::string& out, long long value)          { appendSigned(out, value);   }
+        inline void appendValue(std::string& out, unsigned int value)       { appendUnsigned(out, value); }
+        inline void appendValue(std::string& out, unsigned long value)      { appendUnsigned(out, value); }
+        inline void appendValue(std::string& out, unsigned long long value) { appendUnsigned(out, value); }
+
+        inline void appendValue(std::string& out, float value)       { appendFloat(out, "%g", (double)value); }
+        inline void appendValue(std::string& out, double value)      { appendFloat(out, "%g", value);         }
+        inline void appendValue(std::string& out, long double value) { appendFloat(out, "%Lg", value);        }
+
+        inline void appendValue(std::string& out, bool value) { out += value ? '1' : '0'; }
+        inline void appendValue(std::string& out, char value) { out += value; }
+
+        inline void appendValue(std::string& out, const std::string& value) { out += value; }
+        inline void appendValue(std::string& out, const char* value) {
+            if (value) {
+                out += value;
+            }
+        }
+
+        // Types without a fast path go through their operator<<.
+        template <typename T>
+        void appendValue(std::string& out, const T& value) {
+            std::ostringstream stream;
+            stream << value;
+            out += stream.str();
+        }
+
+        template <typename F>
+        void appendValue(std::string& out, const Lazy<F>& value) { appendValue(out, value()); }
+
+        // Appends the literal text of `format` up to its next placeholder and returns whether there is one.
+        inline bool appendLiteral(std::string& out, const char*& format) {
+            for (;;) {
+                const char* c = format;
+                while (*c && *c != '{' && *c != '}') {
+                    ++c;
+                }
+                out.append(format, c);
+                format = c;
+
+                if (!*c) {
+                    return false;
+                } else if (c[0] == c[1]) {
+                    out += *c;
+                    format += 2;
+                } else if (c[0] == '{' && c[1] == '}') {
+                    return true;
+                } else {
+                    // Lone braces are kept as they are.
+                    out += *c;
+                    ++format;
+                }
+            }
+        }
+
+        // Placeholders without an argument are kept as they are, like renderBinary() does.
+        inline void formatTo(std::string& out, const char* format) {
+            while (appendLiteral(out, format)) {
+                out.append(format, 2);
+                format += 2;
+            }
+        }
+
+        // Appends `format` with its placeholders replaced by the arguments. Never throws on a mismatch:
+        // arguments without a placeholder are appended, separated by spaces. TLOG_FORMAT rules out
+        // mismatches at compile time.
+        template <typename T, typename... Args>
+        void formatTo(std::string& out, const char* format, const T& arg, const Args&... args) {
+            if (appendLiteral(out, format)) {
+                format += 2;
+            } else {
+                out += ' ';
+            }
+            appendValue(out, arg);
+            formatTo(out, format, args...);
+        }
+    }
+
+      ///////////////////////////////////
+     /// Structured key-value fields ///
+    ///////////////////////////////////
+
+    namespace detail {
+        template <typename T>
+        bool isFinite(const T& value, std::true_type) { return std::isfinite(value); }
+        template <typename T>
+        bool isFinite(const T&, std::false_type) { return true; }
+
+        // Infinities and NaN are no valid JSON numbers and thus stored as strings.
+        template <typename T>
+        EFieldType fieldType(const T& value) {
+            return
+                std::is_same<T, bool>::value ? EFieldType::Bool :
+                std::is_same<T, char>::value ? EFieldType::String :
+                std::is_integral<T>::value ? EFieldType::Number :
+                std::is_floating_point<T>::value && isFinite(value, std::is_floating_point<T>{}) ? EFieldType::Number :
+                EFieldType::String;
+        }
+
+        inline void appendFieldValue(std::string& out, bool value) { out += value ? "true" : "false"; }
+
+        // Character types other than char are numbers, and thus rendered as such rather than as characters.
+        inline void appendFieldValue(std::string& out, signed char value)   { appendSigned(out, (long long)value); }
+        inline void appendFieldValue(std::string& out, unsigned char value) { appendUnsigned(out, (unsigned long long)value); }
+        inline void appendFieldValue(std::string& out, wchar_t value)       { appendSigned(out, (long long)value); }
+        inline void appendFieldValue(std::string& out, char16_t value)      { appendUnsigned(out, (unsigned long long)value); }
+        inline void appendFieldValue(std::string& out, char32_t value)      { appendUnsigned(out, (unsigned long long)value); }
+
+        // Renders like the format functions.
+        template <typename T>
+        void appendFieldValue(std::string& out, const T& value) { appendValue(out, value); }
+
+        inline void appendFieldSize(std::string& out, size_t size) {
+            uint32_t size32 = (uint32_t)size;
+            out.append((const char*)&size32, 4);
+        }
+
+        // Encodes a field as read by Fields::forEach(). The value is rendered in place.
+        template <typename T>
+        void appendField(std::string& out, const char* key, const T& value) {
+            out += (char)fieldType(value);
+
+            size_t keySize = std::strlen(key);
+            appendFieldSize(out, keySize);
+            out.append(key, keySize);
+
+            size_t sizePos = out.size();
+            appendFieldSize(out, 0);
+            appendFieldValue(out, value);
+
+            uint32_t size32 = (uint32_t)(out.size() - sizePos - 4);
+            std::memcpy(&out[sizePos], &size32, 4);
+        }
+
+        template <typename F>
+        void appendField(std::string& out, const char* key, const Lazy<F>& value) { appendField(out, key, value()); }
+
+        // Escapes the contents of a JSON string. Runs of characters that need no escaping, including
+        // all bytes of UTF-8 sequences, are appended at once.
+        inline void appendJsonEscaped(std::string& out, const char* str, size_t size) {
+            static const char HEX_DIGITS[] = "0123456789abcdef";
+
+            const char* end = str + size;
+            while (str < end) {
+                const char* run = str;
+                while (str < end && (unsigned char)*str >= 0x20 && *str != '"' && *str != '\\') {
+                    ++str;
+                }
+                out.append(run, str);
+
+                if (str == end) {
+                    break;
+                }
+
+                unsigned char c = (unsigned char)*str++;
+                switch (c) {
+                    case '"':  out += "\\\""; break;
+                    case '\\': out += "\\\\"; break;
+                    case '\n': out += "\\n"; break;
+                    case '\r': out += "\\r"; break;
+                    case '\t': out += "\\t"; break;
+                    default: {
+                        char escaped[6] = {'\\', 'u', '0', '0', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 0xf]};
+                        out.append(escaped, sizeof(escaped));
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Values with spaces, quotes, backslashes, equal signs or control characters are quoted.
+        inline void appendLogfmtValue(std::string& out, const char* str, size_t size) {
+            bool needsQuotes = size == 0;
+            for (size_t i = 0; i < size && !needsQuotes; ++i) {
+                unsigned char c = (unsigned char)str[i];
+                needsQuotes = c <= ' ' || c == '"' || c == '\\' || c == '=';
+            }
+
+            if (!needsQuotes) {
+                out.append(str, size);
+                return;
+            }
+
+            out += '"';
+            appendJsonEscaped(out, str, size);
+            out += '"';
+        }
+
+        // Keys can not be quoted, so the characters that would need quotes become underscores.
+        inline void appendLogfmtKey(std::string& out, const char* key, size_t size) {
+            for (size_t i = 0; i < size; ++i) {
+                unsigned char c = (unsigned char)key[i];
+                out += c <= ' ' || c == '"' || c == '\\' || c == '=' ? '_' : (char)c;
+            }
+        }
+
+        // ` key=value` for every field. Text outputs show fields like this after the text.
+        inline void appendLogfmtFields(std::string& out, const Fields& fields) {
+            fields.forEach([&](const Field& field) {
+                out += ' ';
+                appendLogfmtKey(out, field.key, field.keySize);
+                out += '=';
+                appendLogfmtValue(out, field.value, field.valueSize);
+            });
+        }
+    }
+
+      ////////////////////////////////////
+     /// Stats about logging itself ///
+    ////////////////////////////////////
+
+    // Collecting stats costs a clock read around every write, so it is off by default. Loggers count
+    // records per severity; outputs count the records handed to them, the time spent writing them,
+    // and the bytes they hand to the operating system. See Logger::stats() and StatsReporter.
+    inline std::atomic<bool>& statsFlag() {
+        static std::atomic<bool> flag{false};
+        return flag;
+    }
+
+    inline void enableStats(bool enabled = true) { statsFlag().store(enabled, std::memory_order_relaxed); }
+    inline bool statsEnabled() { return statsFlag().load(std::memory_order_relaxed); }
+
+    // Durations in buckets of powers of two nanoseconds. Bucket i counts durations in [2^i, 2^(i+1)) ns,
+    // except for the first, which starts at zero, and the last, which has no upper bound.
+    struct LatencyStats {
+        static const size_t NUM_BUCKETS = 32;
+
+        uint64_t count = 0;
+        uint64_t totalNs = 0;
+        uint64_t maxNs = 0;
+        uint64_t buckets[NUM_BUCKETS] = {};
+
+        double meanNs() const { return count > 0 ? (double)totalNs / count : 0.0; }
+
+        // Upper bound of the bucket that contains the quantile `q`, e.g. 0.99
+        uint64_t quantileNs(double q) const {
+            uint64_t rank = (uint64_t)std::ceil(q * count);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < NUM_BUCKETS - 1; ++i) {
+                seen += buckets[i];
+                if (seen >= rank && seen > 0) {
+                    return std::min<uint64_t>(2ull << i, maxNs);
+                }
+            }
+            return maxNs;
+        }
+    };
+
+    struct OutputStats {
+        std::string name;
+        // Handed to the output by loggers and outputs in front of it
+        uint64_t numRecords = 0;
+        // Time spent in writing records, as seen by the caller
+        LatencyStats writeLatency;
+        // Handed to the operating system, and the time each of these writes took
+        uint64_t numBytesWritten = 0;
+        LatencyStats flushLatency;
+        // Only for outputs with a queue, such as AsyncOutput
+        size_t queueSize = 0;
+        size_t queueHighWater = 0;
+        uint64_t numDropped = 0;
+    };
+
+    struct LoggerStats {
+        static const size_t NUM_SEVERITIES = (size_t)ESeverity::Progress + 1;
+
+        std::string scope;
+        // Indexed by ESeverity; hidden severities are not counted
+        uint64_t numRecords[NUM_SEVERITIES] = {};
+        std::vector<OutputStats> outputs;
+
+        // One line, e.g. for logging it.
+        std::string toString() const;
+        // The Prometheus text exposition format.
+        std::string toPrometheus() const;
+    };
+
+    namespace detail {
+        class LatencyHistogram {
+        public:
+            LatencyHistogram() {
+                for (auto& bucket : mBuckets) {
+                    bucket.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            void add(std::chrono::steady_clock::duration duration) {
+                uint64_t ns = (uint64_t)std::max<long long>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+
+                size_t bucket = 0;
+                for (uint64_t rest = ns >> 1; rest > 0 && bucket < LatencyStats::NUM_BUCKETS - 1; rest >>= 1) {
+                    ++bucket;
+                }
+
+                mBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+                mCount.fetch_add(1, std::memory_order_relaxed);
+                mTotalNs.fetch_add(ns, std::memory_order_relaxed);
+
+                uint64_t max = mMaxNs.load(std::memory_order_relaxed);
+                while (ns > max && !mMaxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+            }
+
+            LatencyStats snapshot() const {
+                LatencyStats stats;
+                stats.count = mCount.load(std::memory_order_relaxed);
+                stats.totalNs = mTotalNs.load(std::memory_order_relaxed);
+                stats.maxNs = mMaxNs.load(std::memory_order_relaxed);
+                for (size_t i = 0; i < LatencyStats::NUM_BUCKETS; ++i) {
+                    stats.buckets[i] = mBuckets[i].load(std::memory_order_relaxed);
+                }
+                return stats;
+            }
+
+        private:
+            std::atomic<uint64_t> mBuckets[LatencyStats::NUM_BUCKETS];
+            std::atomic<uint64_t> mCount{0};
+            std::atomic<uint64_t> mTotalNs{0};
+            std::atomic<uint64_t> mMaxNs{0};
+        };
+
+        // Starts from zero, also when copied.
+        struct SeverityCounters {
+            std::atomic<uint64_t> counts[LoggerStats::NUM_SEVERITIES];
+
+            SeverityCounters() {
+                for (auto& count : counts) {
+                    count.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            SeverityCounters(const SeverityCounters&) : SeverityCounters() {}
+            SeverityCounters& operator=(const SeverityCounters&) { return *this; }
+
+            void add(ESeverity severity) { counts[(size_t)severity].fetch_add(1, std::memory_order_relaxed); }
+        };
+    }
+
+    namespace detail {
+        // E.g. 850ns, 1.2us or 3.4ms
+        inline std::string nanosecondsToString(uint64_t ns) {
+            const char* units[] = {"ns", "us", "ms", "s"};
+            double value = (double)ns;
+            size_t unit = 0;
+            while (value >= 1000 && unit < 3) {
+                value /= 1000;
+                ++unit;
+            }
+
+            char text[32];
+            std::snprintf(text, sizeof(text), unit == 0 || value >= 100 ? "%.0f%s" : "%.1f%s", value, units[unit]);
+            return text;
+        }
+
+        inline std::string lowercase(std::string str) {
+            for (auto& c : str) {
+                c = (char)std::tolower((unsigned char)c);
+            }
+            return str;
+        }
+
+        inline std::string prometheusLabel(const std::string& value) {
+            std::string result;
+            for (char c : value) {
+                switch (c) {
+                    case '\\': result += "\\\\"; break;
+                    case '"':  result += "\\\""; break;
+                    case '\n': result += "\\n";  break;
+                    default:   result += c;      break;
+                }
+            }
+            return result;
+        }
+
+        inline void appendPrometheusHistogram(std::string& out, const std::string& metric, const std::string& labels, const LatencyStats& stats) {
+            char value[32];
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < LatencyStats::NUM_BUCKETS - 1; ++i) {
+                cumulative += stats.buckets[i];
+                std::snprintf(value, sizeof(value), "%g", (double)(2ull << i) * 1e-9);
+                out += metric + "_bucket{" + labels + ",le=\"" + value + "\"} " + std::to_string(cumulative) + "\n";
+            }
+            out += metric + "_bucket{" + labels + ",le=\"+Inf\"} " + std::to_string(stats.count) + "\n";
+
+            std::snprintf(value, sizeof(value), "%g", (double)stats.totalNs * 1e-9);
+            out += metric + "_sum{" + labels + "} " + value + "\n";
+            out += metric + "_count{" + labels + "} " + std::to_string(stats.count) + "\n";
+        }
+    }
+
+    inline std::string LoggerStats::toString() const {
+        std::string result = "records:";
+        for (size_t i = 0; i < NUM_SEVERITIES; ++i) {
+            if (numRecords[i] > 0) {
+                const char* name = detail::severityName((ESeverity)i);
+                result += ' ';
+                result += *name ? name : "NONE";
+                result += '=';
+                result += std::to_string(numRecords[i]);
+            }
+        }
+
+        for (auto& output : outputs) {
+            result += "; " + (output.name.empty() ? std::string{"output"} : output.name) + ": ";
+            result += std::to_string(output.numRecords) + " records";
+            if (output.writeLatency.count > 0) {
+                result += ", write p50 " + detail::nanosecondsToString(output.writeLatency.quantileNs(0.5));
+                result += " p99 " + detail::nanosecondsToString(output.writeLatency.quantileNs(0.99));
+                result += " max " + detail::nanosecondsToString(output.writeLatency.maxNs);
+            }
+            if (output.flushLatency.count > 0) {
+                result += ", " + std::to_string(output.numBytesWritten) + " bytes in " + std::to_string(output.flushLatency.count) + " writes";
+                result += " p99 " + detail::nanosecondsToString(output.flushLatency.quantileNs(0.99));
+            }
+            if (output.queueHighWater > 0 || output.numDropped > 0) {
+                result += ", queue " + std::to_string(output.queueSize) + " max " + std::to_string(output.queueHighWater);
+                result += ", " + std::to_string(output.numDropped) + " dropped";
+            }
+        }
+        return result;
+    }
+
+    inline std::string LoggerStats::toPrometheus() const {
+        std::string out;
+        std::string scopeLabel = "scope=\"" + detail::prometheusLabel(scope) + "\"";
+
+        out += "# TYPE tlog_records_total counter\n";
+        for (size_t i = 0; i < NUM_SEVERITIES; ++i) {
+            const char* name = detail::severityName((ESeverity)i);
+            out += "tlog_records_total{" + scopeLabel + ",severity=\"" + detail::lowercase(*name ? name : "none") + "\"} ";
+            out += std::to_string(numRecords[i]) + "\n";
+        }
+
+        std::vector<std::string> labels;
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            const std::string& name = outputs[i].name.empty() ? std::to_string(i) : outputs[i].name;
+            labels.push_back(scopeLabel + ",output=\"" + detail::prometheusLabel(name) + "\"");
+        }
+
+        struct Counter {
+            const char* metric;
+            const char* type;
+            uint64_t (*get)(const OutputStats&);
+        };
+
+        const Counter counters[] = {
+            {"tlog_output_records_total",      "counter", [](const OutputStats& s) { return s.numRecords; }},
+            {"tlog_output_bytes_written_total", "counter", [](const OutputStats& s) { return s.numBytesWritten; }},
+            {"tlog_output_dropped_total",      "counter", [](const OutputStats& s) { return s.numDropped; }},
+            {"tlog_output_queue_size",         "gauge",   [](const OutputStats& s) { return (uint64_t)s.queueSize; }},
+            {"tlog_output_queue_high_water",   "gauge",   [](const OutputStats& s) { return (uint64_t)s.queueHighWater; }},
+        };
+
+        for (auto& counter : counters) {
+            out += std::string{"# TYPE "} + counter.metric + " " + counter.type + "\n";
+            for (size_t i = 0; i < outputs.size(); ++i) {
+                out += std::string{counter.metric} + "{" + labels[i] + "} " + std::to_string(counter.get(outputs[i])) + "\n";
+            }
+        }
+
+        out += "# TYPE tlog_output_write_seconds histogram\n";
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            detail::appendPrometheusHistogram(out, "tlog_output_write_seconds", labels[i], outputs[i].writeLatency);
+        }
+
+        out += "# TYPE tlog_output_flush_seconds histogram\n";
+        for (size_t i = 0; i < outputs.size(); ++i) {
+            detail::appendPrometheusHistogram(out, "tlog_output_flush_seconds", labels[i], outputs[i].flushLatency);
+        }
+
+        return out;
+    }
+
+    // Outputs may be written to by multiple loggers, and hence threads, at the same time. The
+    // built-in outputs serialize their writes internally. Custom outputs must do the same, or be
+    // wrapped in an AsyncOutput, which only ever calls them from its worker thread.
+    class IOutput {
+    public:
+        virtual ~IOutput() = default;
+
+        virtual void writeLine(const std::string& scope, ESeverity severity, const std::string& line) = 0;
+        virtual void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) = 0;
+
+        // Called by the logger for every line. The default implementation copies the text and forwards
+        // it to writeLine(). Outputs that are able to consume the text in place should override this.
+        virtual void writeRecord(const Record& record) {
+            writeLine(*record.scope, record.severity, std::string{record.text, record.size});
+        }
+
+        // Writes several records at once, e.g. when AsyncOutput drains its queue. Outputs that can coalesce
+        // them into fewer system calls should override this; by default they are written one by one.
+        virtual void writeBatch(const Record* records, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                writeRecord(records[i]);
+            }
+        }
+
+        // Called by the logger for binary records (see TLOG_BINARY). The default implementation renders
+        // the text right away and forwards it to writeRecord(). Outputs that store records in binary
+        // form, such as BinaryFileOutput, override this to defer the formatting.
+        virtual void writeBinary(const BinaryRecord& record) {
+            detail::ScratchString text;
+            detail::renderBinary(text.get(), record.format->format(), record.args, record.size);
+            writeRecord({record.format->severity(), record.scope, text.get().data(), text.get().size(), record.time, record.thread, {}});
+        }
+
+        // Whether writeDeferred() keeps records to render them later, such that the logger has to hand
+        // them over unrendered. Outputs that render right away should leave it to the logger.
+        virtual bool defersRendering() const { return false; }
+
+        // Called by the logger for deferred records (see Logger::logDeferred()) if defersRendering().
+        // The default implementation renders the text right away and forwards it to writeRecord().
+        virtual void writeDeferred(const DeferredRecord& record) {
+            detail::ScratchString text;
+            (*record.render)(text.get());
+            writeRecord({record.severity, record.scope, text.get().data(), text.get().size(), record.time, record.thread, {}});
+        }
+
+        // Hands all buffered text to the operating system.
+        virtual void flush() {}
+
+        // Called by the crash handler (see installCrashHandler()) from within a signal handler, while other
+        // threads may still be logging. Writes whatever the output still holds in memory using nothing but
+        // write(2) and preallocated memory; must neither lock nor allocate. Only the first call writes.
+        virtual void flushOnCrash() {}
+
+        // Writes a record that an output in front of this one, such as AsyncOutput, still held. Called
+        // by the crash handler with the restrictions of flushOnCrash(), which it implies.
+        virtual void writeRecordOnCrash(const Record&) {}
+
+        static Record makeRecord(const std::string& scope, ESeverity severity, const std::string& line) {
+            return {severity, &scope, line.data(), line.size(), std::chrono::system_clock::now(), detail::threadIndex(), {}};
+        }
+
+        // Identifies the output in its stats, e.g. by its file name.
+        virtual std::string name() const { return ""; }
+
+        // What was counted while enableStats() was on. Outputs with a queue add its state.
+        virtual OutputStats stats() const {
+            OutputStats result;
+            result.name = name();
+            result.numRecords = mNumRecords.load(std::memory_order_relaxed);
+            result.writeLatency = mWriteLatency.snapshot();
+            result.numBytesWritten = mNumBytesWritten.load(std::memory_order_relaxed);
+            result.flushLatency = mFlushLatency.snapshot();
+            return result;
+        }
+
+        // Loggers, and outputs that forward to others, call these instead of writeRecord(), writeBatch(),
+        // writeBinary() and writeDeferred(), such that the time spent in them is counted while stats are enabled.
+        void timedWriteRecord(const Record& record) {
+            auto start = statsStart();
+            writeRecord(record);
+            countWrite(1, start);
+        }
+
+        void timedWriteBatch(const Record* records, size_t count) {
+            auto start = statsStart();
+            writeBatch(records, count);
+            countWrite(count, start);
+        }
+
+        void timedWriteBinary(const BinaryRecord& record) {
+            auto start = statsStart();
+            writeBinary(record);
+            countWrite(1, start);
+        }
+
+        void timedWriteDeferred(const DeferredRecord& record) {
+            auto start = statsStart();
+            writeDeferred(record);
+            countWrite(1, start);
+        }
+
+    protected:
+        // For outputs to count what they hand to the operating system:
+        //     auto start = statsStart(); write(...); countFlush(size, start);
+        static std::chrono::steady_clock::time_point statsStart() {
+            return statsEnabled() ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+        }
+
+        void countFlush(size_t numBytes, std::chrono::steady_clock::time_point start) {
+            if (start != std::chrono::steady_clock::time_point{}) {
+                mNumBytesWritten.fetch_add(numBytes, std::memory_order_relaxed);
+                mFlushLatency.add(std::chrono::steady_clock::now() - start);
+            }
+        }
+
+    private:
+        void countWrite(size_t numRecords, std::chrono::steady_clock::time_point start) {
+            if (start != std::chrono::steady_clock::time_point{}) {
+                mNumRecords.fetch_add(numRecords, std::memory_order_relaxed);
+                mWriteLatency.add(std::chrono::steady_clock::now() - start);
+            }
+        }
+
+        std::atomic<uint64_t> mNumRecords{0};
+        std::atomic<uint64_t> mNumBytesWritten{0};
+        detail::LatencyHistogram mWriteLatency;
+        detail::LatencyHistogram mFlushLatency;
+    };
+
+    namespace detail {
+        // Keeps the first occurrence of every output, such that records are handed on in the given order.
+        inline std::vector<std::shared_ptr<IOutput>> uniqueOutputs(const std::vector<std::shared_ptr<IOutput>>& outputs) {
+            std::vector<std::shared_ptr<IOutput>> result;
+            for (auto& output : outputs) {
+                if (std::find(result.begin(), result.end(), output) == result.end()) {
+                    result.push_back(output);
+                }
+            }
+            return result;
+        }
+    }
+
+
+      /////////////////////////////////
+     /// Flushing on fatal signals ///
+    /////////////////////////////////
+
+    namespace detail {
+        // Outputs that hold records in memory, so that the crash handler can write them. Lock-free, as the
+        // crash handler walks it from a signal handler.
+        class CrashHandler {
+        public:
+            // Outputs beyond the capacity of the registry are not written on a crash.
+            static void add(IOutput* output) {
+                for (auto& slot : slots().outputs) {
+                    IOutput* expected = nullptr;
+                    if (slot.compare_exchange_strong(expected, output)) {
+                        return;
+                    }
+                }
+            }
+
+            static void remove(IOutput* output) {
+                for (auto& slot : slots().outputs) {
+                    IOutput* expected = output;
+                    if (slot.compare_exchange_strong(expected, nullptr)) {
+                        return;
+                    }
+                }
+            }
+
+#ifndef _WIN32
+            static void install(const std::vector<int>& signals);
+#endif
+
+        private:
+            // Plain static storage, which is zero-initialized before any code runs.
+            struct Slots {
+                std::atomic<IOutput*> outputs[64];
+            };
+
+            static Slots& slots() {
+                static Slots slots;
+                return slots;
+            }
+
+#ifndef _WIN32
+            static struct sigaction* previousActions() {
+                static struct sigaction actions[NSIG];
+                return actions;
+            }
+
+            static void handle(int signal, siginfo_t* info, void* context);
+#endif
+        };
+
+#ifndef _WIN32
+        // Writes all of `data`. Unlike most other ways of writing, write(2) is async-signal-safe.
+        inline void writeAll(int fd, const char* data, size_t size) {
+            while (size > 0) {
+                ssize_t n = ::write(fd, data, size);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return;
+                }
+                data += n;
+                size -= (size_t)n;
+            }
+        }
+
+        // Preallocated storage for the lines that outputs render within the crash handler, where nothing
+        // may allocate. Only one thread at a time runs the crash handler. Longer lines are truncated.
+        class CrashBuffer {
+        public:
+            static void append(const char* str, size_t size) {
+                State& s = state();
+                size = std::min(size, sizeof(s.data) - s.size);
+                std::memcpy(s.data + s.size, str, size);
+                s.size += size;
+            }
+
+            static void append(const char* str) { append(str, std::strlen(str)); }
+            static void append(const std::string& str) { append(str.data(), str.size()); }
+
+            // Like TimestampCache::append(). localtime_r() is not async-signal-safe, so the offset to UTC is
+            // taken when the crash handler is installed; a change of daylight saving time since is ignored.
+            static void appendTime(std::chrono::system_clock::time_point time, const TimestampCache& timestamp) {
+                long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+                long long second = ns / 1000000000 + state().utcOffset;
+                long long secondOfDay = (second % 86400 + 86400) % 86400;
+
+                char text[32] = {
+                    (char)('0' + secondOfDay / 36000), (char)('0' + secondOfDay / 3600 % 10), ':',
+                    (char)('0' + secondOfDay % 3600 / 600), (char)('0' + secondOfDay % 3600 / 60 % 10), ':',
+                    (char)('0' + secondOfDay % 60 / 10), (char)('0' + secondOfDay % 10), '.',
+                };
+
+                long long fraction = (ns % 1000000000 + 1000000000) % 1000000000;
+                for (size_t i = 9 + 8; i >= 9; --i, fraction /= 10) {
+                    text[i] = (char)('0' + fraction % 10);
+                }
+                append(text, timestamp.length());
+            }
+
+            // The layout of FileOutput::appendLine() without its line break. Prefixes that `prefixes` has
+            // not rendered before are rendered without colors.
+            static void appendLine(const Record& record, const TimestampCache& timestamp, const PrefixCache& prefixes) {
+                if (record.severity != ESeverity::None) {
+                    appendTime(record.time, timestamp);
+                    append(" ", 1);
+                }
+
+                if (const std::string* prefix = prefixes.find(*record.scope, record.severity)) {
+                    append(*prefix);
+                } else {
+                    if (!record.scope->empty()) {
+                        append("[", 1);
+                        append(*record.scope);
+                        append("] ", 2);
+                    }
+
+                    append(severityName(record.severity));
+                    if (record.severity != ESeverity::None) {
+                        append(" ", 1);
+                    }
+                }
+
+                append(record.text, record.size);
+            }
+
+            // Writes and empties the buffer.
+            static void writeTo(int fd) {
+                State& s = state();
+                writeAll(fd, s.data, s.size);
+                s.size = 0;
+            }
+
+            static void setUtcOffset(long long seconds) { state().utcOffset = seconds; }
+
+        private:
+            struct State {
+                char data[64 * 1024];
+                size_t size;
+                long long utcOffset;
+            };
+
+            static State& state() {
+                static State state;
+                return state;
+            }
+        };
+
+        // The crash state of a file-based output. The file is opened again by its name, as std::ofstream
+        // does not expose its descriptor.
+        class CrashFile {
+        public:
+            // Only the first call writes the pending text. `fallback` is opened if `path` does not exist.
+            void flush(const std::string& path, const std::string& pending, const std::string& fallback = "") {
+                if (mFlushed.exchange(true) || path.empty()) {
+                    return;
+                }
+
+                mFd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+                if (mFd < 0 && !fallback.empty()) {
+                    mFd = ::open(fallback.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+                }
+                if (mFd >= 0) {
+                    writeAll(mFd, pending.data(), pending.size());
+                }
+            }
+
+            void writeLine(const Record& record, const TimestampCache& timestamp, const PrefixCache& prefixes) {
+                if (mFd >= 0) {
+                    CrashBuffer::appendLine(record, timestamp, prefixes);
+                    CrashBuffer::append("\n", 1);
+                    CrashBuffer::writeTo(mFd);
+                }
+            }
+
+        private:
+            std::atomic<bool> mFlushed{false};
+            int mFd = -1;
+        };
+#endif
+    }
+
+#ifndef _WIN32
+    // Opt-in: on any of `signals`, writes what the outputs still hold in memory, such as the pending text
+    // of buffered outputs and the queue of an AsyncOutput, before the signal takes its previous course.
+    // Only async-signal-safe write(2) calls and preallocated memory are used. As other threads may keep
+    // logging while the process crashes, this is a best effort: records currently being handed over by
+    // a worker may be lost. Signals that are ignored stay ignored. Installing more than once has no effect.
+    inline void installCrashHandler(const std::vector<int>& signals = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM}) {
+        detail::CrashHandler::install(signals);
+    }
+
+    namespace detail {
+        inline void CrashHandler::install(const std::vector<int>& signals) {
+            static std::mutex mutex;
+            static std::set<int> installed;
+            std::lock_guard<std::mutex> lock{mutex};
+
+            std::time_t now = std::time(nullptr);
+            std::tm localTime;
+            detail::localTime(now, localTime);
+            CrashBuffer::setUtcOffset(localTime.tm_gmtoff);
+
+            for (int signal : signals) {
+                if (signal <= 0 || signal >= NSIG || installed.count(signal) > 0) {
+                    continue;
+                }
+
+                struct sigaction action;
+                std::memset(&action, 0, sizeof(action));
+                action.sa_sigaction = handle;
+                action.sa_flags = SA_SIGINFO;
+                sigemptyset(&action.sa_mask);
+
+                struct sigaction& previous = previousActions()[signal];
+                if (sigaction(signal, nullptr, &previous) != 0) {
+                    throw std::runtime_error{"installCrashHandler: invalid signal " + std::to_string(signal)};
+                }
+
+                if (!(previous.sa_flags & SA_SIGINFO) && previous.sa_handler == SIG_IGN) {
+                    continue;
+                }
+
+                sigaction(signal, &action, nullptr);
+                installed.insert(signal);
+            }
+        }
+
+        inline void CrashHandler::handle(int signal, siginfo_t* info, void* context) {
+            // Threads that crash at the same time wait for the first one to terminate the process.
+            static std::atomic<bool> handling;
+            if (handling.exchange(true)) {
+                for (;;) {
+                    pause();
+                }
+            }
+
+            for (auto& slot : slots().outputs) {
+                if (IOutput* output = slot.load()) {
+                    output->flushOnCrash();
+                }
+            }
+
+            // Hand the signal on as if we had never been there.
+            struct sigaction& previous = previousActions()[signal];
+            if (previous.sa_flags & SA_SIGINFO) {
+                previous.sa_sigaction(signal, info, context);
+            } else if (previous.sa_handler != SIG_DFL) {
+                previous.sa_handler(signal);
+            } else {
+                // Delivered with the default action once the handler returns.
+                sigaction(signal, &previous, nullptr);
+                raise(signal);
+                return;
+            }
+
+            // The previous handler let the process live on.
+            handling.store(false);
+        }
+    }
+#endif
+
+      ///////////////////////////////
+     /// IOutput implementations ///
+    ///////////////////////////////
+
+    namespace ansi {
+        const std::string ESC = "\033";
+
+        const std::string RESET = ESC + "[0m";
+        const std::string LINE_BEGIN = ESC + "[0G";
+        const std::string ERASE_TO_END_OF_LINE = ESC + "[K";
+
+        const std::string BLACK   = ESC + "[0;30m";
+        const std::string RED     = ESC + "[0;31m";
+        const std::string GREEN   = ESC + "[0;32m";
+        const std::string YELLOW  = ESC + "[0;33m";
+        const std::string BLUE    = ESC + "[0;34m";
+        const std::string MAGENTA = ESC + "[0;35m";
+        const std::string CYAN    = ESC + "[0;36m";
+        const std::string WHITE   = ESC + "[0;37m";
+
+        const std::string BOLD_BLACK   = ESC + "[1;30m";
+        const std::string BOLD_RED     = ESC + "[1;31m";
+        const std::string BOLD_GREEN   = ESC + "[1;32m";
+        const std::string BOLD_YELLOW  = ESC + "[1;33m";
+        const std::string BOLD_BLUE    = ESC + "[1;34m";
+        const std::string BOLD_MAGENTA = ESC + "[1;35m";
+        const std::string BOLD_CYAN    = ESC + "[1;36m";
+        const std::string BOLD_WHITE   = ESC + "[1;37m";
+
+        const std::string HIDE_CURSOR = ESC + "[?25l";
+        const std::string SHOW_CURSOR = ESC + "[?25h";
+
+        const std::string ERASE_TO_END_OF_SCREEN = ESC + "[0J";
+
+        inline std::string cursorUp(size_t lines) { return ESC + "[" + std::to_string(lines) + "A"; }
+        inline std::string cursorDown(size_t lines) { return ESC + "[" + std::to_string(lines) + "B"; }
+    }
+
+    namespace detail {
+        // Progress bars that ConsoleOutput keeps below all regular output and redraws in place, see MultiProgress.
+        class ConsoleRegion {
+        public:
+            struct Bar {
+                std::string scope;
+                uint64_t current;
+                uint64_t total;
+                duration_t duration;
+                std::chrono::system_clock::time_point time;
+            };
+
+            virtual ~ConsoleRegion() = default;
+
+            // Called once per frame with the console's lock held. Bars that are done are reported as
+            // `finished` once; the console then prints them above the region for good.
+            virtual void collect(std::vector<Bar>& active, std::vector<Bar>& finished) = 0;
+        };
+    }
+
+    class ConsoleOutput : public IOutput {
+    public:
+        virtual ~ConsoleOutput() {
+            detail::CrashHandler::remove(this);
+            mFlushTask.stop();
+            flush();
+
+            if (mSupportsAnsiControlSequences) {
+                write(EStream::Stdout, ansi::RESET);
+            }
+        }
+
+        static std::shared_ptr<ConsoleOutput>& global() {
+            static auto consoleOutput = std::shared_ptr<ConsoleOutput>(new ConsoleOutput());
+            return consoleOutput;
+        }
+
+        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+            writeRecord(makeRecord(scope, severity, line));
+        }
+
+        // Qualified, such that StaticLogger's direct calls stay free of virtual dispatch.
+        void writeRecord(const Record& record) override {
+            ConsoleOutput::writeBatch(&record, 1);
+        }
+
+        // Consecutive records for the same stream are written at once.
+        void writeBatch(const Record* records, size_t count) override {
+            std::lock_guard<std::mutex> lock{mMutex};
+
+            for (size_t i = 0; i < count; ++i) {
+                // Keep the order of lines across stdout and stderr intact.
+                EStream stream = streamFor(records[i].severity);
+                if (stream != mPendingStream) {
+                    writePending();
+                    mPendingStream = stream;
+                }
+
+                appendLine(mPending.text, records[i]);
+                mPending.add(records[i].severity, mFlushPolicy);
+
+                // Progress bars are only meaningful while they are visible.
+                if (records[i].severity == ESeverity::Progress) {
+                    mPending.urgent = true;
+                }
+            }
+
+            if (mPending.isDue(mFlushPolicy)) {
+                writePending();
+            }
+        }
+
+        void flush() override {
+            std::lock_guard<std::mutex> lock{mMutex};
+            writePending();
+        }
+
+#ifndef _WIN32
+        // Also resets the colors, which the destructor would otherwise do.
+        void flushOnCrash() override {
+            if (mFlushedOnCrash.exchange(true)) {
+                return;
+            }
+
+            detail::writeAll(fileDescriptor(mPendingStream), mPending.text.data(), mPending.text.size());
+            if (mSupportsAnsiControlSequences) {
+                detail::writeAll(1, ansi::RESET.data(), ansi::RESET.size());
+            }
+        }
+
+        void writeRecordOnCrash(const Record& record) override {
+            flushOnCrash();
+
+            detail::CrashBuffer::appendLine(record, mTimestamp, mPrefixes);
+            if (mSupportsAnsiControlSequences) {
+                detail::CrashBuffer::append(ansi::ERASE_TO_END_OF_LINE);
+                detail::CrashBuffer::append(ansi::RESET);
+            }
+            detail::CrashBuffer::append("\n", 1);
+            detail::CrashBuffer::writeTo(fileDescriptor(streamFor(record.severity)));
+        }
+#endif
+
+        std::string name() const override { return "console"; }
+
+        // When stdout is not a terminal, e.g. when it is redirected to a file, progress bars can not be
+        // redrawn in place, so only completed ones are written.
+        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
+            if (!mIsTerminal && current < total) {
+                checkProgress(current, total);
+                return;
+            }
+
+            int width;
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                width = progressBarWidth(scope);
+            }
+
+            detail::ScratchString text;
+            appendProgressBar(text.get(), current, total, duration, width);
+            writeLine(scope, ESeverity::Progress, text.get());
+        }
+
+        // Regions stay below all regular output and are redrawn in place by redrawRegions(). Without a
+        // terminal that understands ANSI control sequences, only finished bars are printed.
+        void attachRegion(detail::ConsoleRegion* region) {
+            std::lock_guard<std::mutex> lock{mMutex};
+            mRegions.push_back(region);
+        }
+
+        // Prints the region's bars in their final state above the remaining regions.
+        void detachRegion(detail::ConsoleRegion* region) {
+            std::lock_guard<std::mutex> lock{mMutex};
+
+            auto it = std::find(mRegions.begin(), mRegions.end(), region);
+            if (it == mRegions.end()) {
+                return;
+            }
+            mRegions.erase(it);
+
+            std::vector<detail::ConsoleRegion::Bar> permanent;
+            region->collect(permanent, permanent);
+            redrawRegionsLocked(std::move(permanent));
+        }
+
+        // Draws one frame, touching only the bars that changed since the last one.
+        void redrawRegions() {
+            std::lock_guard<std::mutex> lock{mMutex};
+            redrawRegionsLocked({});
+        }
+
+        void setTimePrecision(ETimePrecision precision) {
+            std::lock_guard<std::mutex> lock{mMutex};
+            mTimestamp.setPrecision(precision);
+        }
+
+        ETimePrecision timePrecision() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mTimestamp.precision();
+        }
+
+        // Defaults to FlushPolicy::always().
+        void setFlushPolicy(const FlushPolicy& policy) {
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                mFlushPolicy = policy;
+            }
+
+            if (policy.interval.count() > 0) {
+                mFlushTask.start(policy.interval, [this]() { flush(); });
+            } else {
+                mFlushTask.stop();
+            }
+        }
+
+        FlushPolicy flushPolicy() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mFlushPolicy;
+        }
+
+        // Warnings and errors go to stderr by default. Merged, all lines go to stdout in the order in which
+        // they were logged, and every batch takes a single write.
+        void setMergeStreams(bool merge) {
+            std::lock_guard<std::mutex> lock{mMutex};
+            writePending();
+            mMergeStreams.store(merge, std::memory_order_relaxed);
+        }
+
+        bool mergesStreams() const { return mMergeStreams.load(std::memory_order_relaxed); }
+
+    private:
+        enum class EStream {
+            Stdout,
+            Stderr,
+        };
+
+        EStream streamFor(ESeverity severity) const {
+            bool isProblem = severity == ESeverity::Warning || severity == ESeverity::Error;
+            return isProblem && !mMergeStreams.load(std::memory_order_relaxed) ? EStream::Stderr : EStream::Stdout;
+        }
+
+#ifndef _WIN32
+        static int fileDescriptor(EStream stream) {
+            return stream == EStream::Stderr ? STDERR_FILENO : STDOUT_FILENO;
+        }
+#endif
+
+        // Bypasses iostreams and stdio. What the program itself printed through them is handed to the
+        // operating system first, such that it stays in front of the newer lines.
+        static void write(EStream stream, const char* data, size_t size) {
+            std::cout.flush();
+            std::fflush(stdout);
+
+#ifdef _WIN32
+            HANDLE handle = GetStdHandle(stream == EStream::Stderr ? STD_ERROR_HANDLE : STD_OUTPUT_HANDLE);
+            while (size > 0) {
+                DWORD numWritten = 0;
+                DWORD chunkSize = (DWORD)std::min(size, (size_t)(1 << 30));
+                if (!WriteFile(handle, data, chunkSize, &numWritten, nullptr) || numWritten == 0) {
+                    return;
+                }
+                data += numWritten;
+                size -= numWritten;
+            }
+#else
+            detail::writeAll(fileDescriptor(stream), data, size);
+#endif
+        }
+
+        static void write(EStream stream, const std::string& text) {
+            write(stream, text.data(), text.size());
+        }
+
+        void writePending() {
+            if (!mPending.text.empty()) {
+                auto start = statsStart();
+                if (mRegionLines.empty()) {
+                    write(mPendingStream, mPending.text);
+                } else if (mPendingStream == EStream::Stdout) {
+                    // Print above the regions and draw them again below the new text, all in one write.
+                    std::string text = eraseRegions();
+                    text += mPending.text;
+                    appendRegionLines(text);
+                    write(EStream::Stdout, text);
+                } else {
+                    write(EStream::Stdout, eraseRegions());
+                    write(mPendingStream, mPending.text);
+
+                    std::string text;
+                    appendRegionLines(text);
+                    write(EStream::Stdout, text);
+                }
+                countFlush(mPending.text.size(), start);
+            }
+            mPending.reset();
+        }
+
+        // The time string plus a space and the padded severity
+        int progressBarWidth(const std::string& scope) {
+            int width = consoleWidth() - (int)mTimestamp.length() - 10;
+
+            if (!scope.empty()) {
+                width -= 3 + (int)scope.size();
+            }
+
+// Due to a bug in windows' ANSI sequence handling the last character of the line is erased
+// if a clear-to-end-of-line is issued while the cursor is after the last character of a line
+// (i.e. if the control character would be on a new line if it was a regular character).
+#ifdef _WIN32
+            if (mSupportsAnsiControlSequences) {
+                width -= 1;
+            }
+#endif
+
+            return std::max(0, width);
+        }
+
+        void appendBarLine(std::string& textOut, const detail::ConsoleRegion::Bar& bar) {
+            detail::ScratchString text;
+            appendProgressBar(text.get(), bar.current, bar.total, bar.duration, progressBarWidth(bar.scope));
+            appendLineContent(textOut, {ESeverity::Progress, &bar.scope, text.get().data(), text.get().size(), bar.time, detail::threadIndex(), {}});
+        }
+
+        // Assumes the cursor to be at the beginning of the line below the regions.
+        std::string eraseRegions() const {
+            if (mRegionLines.empty()) {
+                return {};
+            }
+            return ansi::cursorUp(mRegionLines.size()) + ansi::LINE_BEGIN + ansi::ERASE_TO_END_OF_SCREEN;
+        }
+
+        void appendRegionLines(std::string& textOut) const {
+            for (auto& line : mRegionLines) {
+                textOut += line;
+                textOut += '\n';
+            }
+        }
+
+        void redrawRegionsLocked(std::vector<detail::ConsoleRegion::Bar> permanent) {
+            // Keep regular text above the bars that finish in this frame.
+            writePending();
+
+            std::vector<detail::ConsoleRegion::Bar> active;
+            for (auto region : mRegions) {
+                region->collect(active, permanent);
+            }
+
+            std::string text;
+            if (!mSupportsAnsiControlSequences) {
+                for (auto& bar : permanent) {
+                    appendBarLine(text, bar);
+                    text += '\n';
+                }
+            } else {
+                std::vector<std::string> lines(active.size());
+                for (size_t i = 0; i < active.size(); ++i) {
+                    appendBarLine(lines[i], active[i]);
+                }
+
+                if (!permanent.empty() || lines.size() != mRegionLines.size()) {
+                    text = eraseRegions();
+                    for (auto& bar : permanent) {
+                        appendBarLine(text, bar);
+                        text += '\n';
+                    }
+
+                    mRegionLines = std::move(lines);
+                    appendRegionLines(text);
+                } else {
+                    size_t numLines = lines.size();
+                    for (size_t i = 0; i < numLines; ++i) {
+                        if (lines[i] != mRegionLines[i]) {
+                            text += ansi::cursorUp(numLines - i);
+                            text += ansi::LINE_BEGIN;
+                            text += lines[i];
+                            text += ansi::cursorDown(numLines - i);
+                            text += ansi::LINE_BEGIN;
+                        }
+                    }
+
+                    mRegionLines = std::move(lines);
+                }
+            }
+
+            if (!text.empty()) {
+                write(EStream::Stdout, text);
+            }
+        }
+
+        void appendLine(std::string& textOut, const Record& record) {
+            appendLineContent(textOut, record);
+
+            // Make sure there is a linebreak in the end. We don't want duplicates!
+            if (mSupportsAnsiControlSequences && record.severity == ESeverity::Progress) {
+                textOut += ansi::LINE_BEGIN;
+            } else {
+                textOut += '\n';
+            }
+        }
+
+        void appendLineContent(std::string& textOut, const Record& record) {
+            if (record.severity != ESeverity::None) {
+                mTimestamp.append(textOut, record.time);
+                textOut += ' ';
+            }
+
+            textOut += mPrefixes.get(*record.scope, record.severity, [this](std::string& prefix, const std::string& scope, ESeverity severity) {
+                renderPrefix(prefix, scope, severity);
+            });
+
+            textOut.append(record.text, record.size);
+            detail::appendLogfmtFields(textOut, record.fields);
+
+            if (mSupportsAnsiControlSequences) {
+                textOut += ansi::ERASE_TO_END_OF_LINE;
+                textOut += ansi::RESET;
+            }
+        }
+
+        void renderPrefix(std::string& textOut, const std::string& scope, ESeverity severity) const {
+            // Color for severities
+            if (mSupportsAnsiControlSequences) {
+                switch (severity) {
+                    case ESeverity::Success:  textOut += ansi::GREEN;       break;
+                    case ESeverity::Info:     textOut += ansi::CYAN;        break;
+                    case ESeverity::Warning:  textOut += ansi::BOLD_YELLOW; break;
+                    case ESeverity::Debug:    textOut += ansi::MAGENTA;     break;
+                    case ESeverity::Error:    textOut += ansi::BOLD_RED;    break;
+                    case ESeverity::Progress: textOut += ansi::BLUE;        break;
+                    default:                                                break;
+                }
+            }
+
+            auto severityStr = severityToString(severity);
+            if (severity != ESeverity::None) {
+                severityStr = padFromRight(severityStr, 9);
+            }
+            textOut += severityStr;
+
+            if (!scope.empty()) {
+                if (mSupportsAnsiControlSequences) {
+                    textOut += ansi::BOLD_WHITE;
+                }
+
+                textOut += '[';
+                textOut += scope;
+                textOut += "] ";
+            }
+
+            if (mSupportsAnsiControlSequences && severity != ESeverity::None) {
+                textOut += ansi::RESET;
+            }
+        }
+
+        ConsoleOutput() {
+            mIsTerminal = isTerminal();
+            mSupportsAnsiControlSequences = mIsTerminal && enableAnsiControlSequences();
+            if (mSupportsAnsiControlSequences) {
+                write(EStream::Stdout, ansi::RESET);
+            }
+
+            mConsoleWidth = queryConsoleWidth();
+#ifndef _WIN32
+            if (mIsTerminal) {
+                watchConsoleWidth();
+            }
+#endif
+
+            detail::CrashHandler::add(this);
+        }
+
+        static bool isTerminal() {
+#ifdef _WIN32
+            DWORD mode;
+            return GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &mode) != 0;
+#else
+            return isatty(STDOUT_FILENO) != 0;
+#endif
+        }
+
+        static bool enableAnsiControlSequences() {
+            char* noColorEnv = getenv("NO_COLOR");
+            if (noColorEnv && noColorEnv[0] != '\0') {
+                return false;
+            }
+
+#ifdef _WIN32
+            // Set output mode to handle virtual terminal sequences
+            HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+            if (hOut == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            DWORD dwMode = 0;
+            if (!GetConsoleMode(hOut, &dwMode)) {
+                return false;
+            }
+            dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+            if (!SetConsoleMode(hOut, dwMode)) {
+                return false;
+            }
+#endif
+            return true;
+        }
+
+        // Falls back to $COLUMNS, or 80 columns, if stdout is not a terminal.
+        static int queryConsoleWidth() {
+#ifdef _WIN32
+            CONSOLE_SCREEN_BUFFER_INFO csbi;
+            if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi)) {
+                return csbi.srWindow.Right - csbi.srWindow.Left + 1;
+            }
+#else
+            winsize size;
+            if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+                return size.ws_col;
+            }
+#endif
+
+            char* columnsEnv = getenv("COLUMNS");
+            int columns = columnsEnv ? std::atoi(columnsEnv) : 0;
+            return columns > 0 ? columns : 80;
+        }
+
+        // Requires mMutex. The width is only queried again after the console was resized.
+        int consoleWidth() {
+#ifdef _WIN32
+            // Windows only reports resizes as console input events, which are not ours to consume. Poll instead.
+            auto now = std::chrono::steady_clock::now();
+            if (now - mConsoleWidthTime > std::chrono::milliseconds{500}) {
+                mConsoleWidth = queryConsoleWidth();
+                mConsoleWidthTime = now;
+            }
+#else
+            if (consoleResized().exchange(false, std::memory_order_relaxed)) {
+                mConsoleWidth = queryConsoleWidth();
+            }
+#endif
+            return mConsoleWidth;
+        }
+
+#ifndef _WIN32
+        static std::atomic<bool>& consoleResized() {
+            static std::atomic<bool> resized{false};
+            return resized;
+        }
+
+        static struct sigaction& previousResizeAction() {
+            static struct sigaction action;
+            return action;
+        }
+
+        // Only touches a lock-free atomic, and passes the signal on to whichever handler was installed before.
+        static void handleResize(int signal, siginfo_t* info, void* context) {
+            consoleResized().store(true, std::memory_order_relaxed);
+
+            const struct sigaction& previous = previousResizeAction();
+            if (previous.sa_flags & SA_SIGINFO) {
+                if (previous.sa_sigaction) {
+                    previous.sa_sigaction(signal, info, context);
+                }
+            } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+                previous.sa_handler(signal);
+            }
+        }
+
+        static void watchConsoleWidth() {
+            // Initialize the statics outside of the signal handler.
+            consoleResized();
+
+            struct sigaction action;
+            std::memset(&action, 0, sizeof(action));
+            action.sa_sigaction = handleResize;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGWINCH, &action, &previousResizeAction());
+        }
+#endif
+
+        bool mIsTerminal;
+        bool mSupportsAnsiControlSequences;
+
+        // Serializes writes of concurrent loggers. Guards everything below.
+        mutable std::mutex mMutex;
+
+        TimestampCache mTimestamp;
+        detail::PrefixCache mPrefixes;
+
+        FlushPolicy mFlushPolicy = FlushPolicy::always();
+        detail::PendingText mPending;
+        EStream mPendingStream = EStream::Stdout;
+        std::atomic<bool> mMergeStreams{false};
+
+        std::atomic<bool> mFlushedOnCrash{false};
+
+        std::vector<detail::ConsoleRegion*> mRegions;
+        // What the regions currently show on screen.
+        std::vector<std::string> mRegionLines;
+
+        int mConsoleWidth;
+#ifdef _WIN32
+        std::chrono::steady_clock::time_point mConsoleWidthTime = std::chrono::steady_clock::now();
+#endif
+
+        detail::PeriodicTask mFlushTask;
+    };
+
+    namespace detail {
+        // The layout of FileOutput: HH:MM:SS [scope] SEVERITY text key=value...
+        class TextLayout {
+        public:
+            static void appendLine(std::string& textOut, TimestampCache& timestamp, PrefixCache& prefixes, const Record& record) {
+                if (record.severity != ESeverity::None) {
+                    timestamp.append(textOut, record.time);
+                    textOut += ' ';
+                }
+
+                textOut += prefixes.get(*record.scope, record.severity, renderPrefix);
+                textOut.append(record.text, record.size);
+                appendLogfmtFields(textOut, record.fields);
+                textOut += '\n';
+            }
+
+            static void renderPrefix(std::string& textOut, const std::string& scope, ESeverity severity) {
+                if (!scope.empty()) {
+                    textOut += '[';
+                    textOut += scope;
+                    textOut += "] ";
+                }
+
+                textOut += severityToString(severity);
+                if (severity != ESeverity::None) {
+                    textOut += ' ';
+                }
+            }
+
+            void append(std::string& textOut, const Record& record) {
+                appendLine(textOut, mTimestamp, mPrefixes, record);
+            }
+
+#ifndef _WIN32
+            void writeOnCrash(CrashFile& crash, const Record& record) const {
+                crash.writeLine(record, mTimestamp, mPrefixes);
+            }
+#endif
+
+            TimestampCache& timestamp() { return mTimestamp; }
+            const TimestampCache& timestamp() const { return mTimestamp; }
+
+        private:
+            TimestampCache mTimestamp;
+            PrefixCache mPrefixes;
+        };
+
+        // The layout of JsonOutput.
+        class JsonLayout {
+        public:
+            void append(std::string& textOut, const Record& record) {
+                textOut += "{\"time\":\"";
+                mTimestamp.append(textOut, record.time);
+                textOut += "\",\"severity\":\"";
+                textOut += severityLevel(record.severity);
+                textOut += '"';
+
+                if (!record.scope->empty()) {
+                    textOut += ",\"scope\":\"";
+                    appendJsonEscaped(textOut, record.scope->data(), record.scope->size());
+                    textOut += '"';
+                }
+
+                textOut += ",\"thread\":";
+                appendUnsigned(textOut, record.thread);
+                textOut += ",\"message\":\"";
+                appendJsonEscaped(textOut, record.text, record.size);
+                textOut += '"';
+
+                record.fields.forEach([&](const Field& field) {
+                    textOut += ",\"";
+                    appendJsonEscaped(textOut, field.key, field.keySize);
+                    textOut += "\":";
+                    if (field.type == EFieldType::String) {
+                        textOut += '"';
+                        appendJsonEscaped(textOut, field.value, field.valueSize);
+                        textOut += '"';
+                    } else {
+                        textOut.append(field.value, field.valueSize);
+                    }
+                });
+
+                textOut += "}\n";
+            }
+
+#ifndef _WIN32
+            // Rendering the record would allocate, and a line of another layout would break the file.
+            void writeOnCrash(CrashFile&, const Record&) const {}
+#endif
+
+        private:
+            UtcTimestampCache mTimestamp;
+        };
+
+        // The layout of LogfmtOutput.
+        class LogfmtLayout {
+        public:
+            void append(std::string& textOut, const Record& record) {
+                textOut += "time=";
+                mTimestamp.append(textOut, record.time);
+                textOut += " level=";
+                textOut += severityLevel(record.severity);
+
+                if (!record.scope->empty()) {
+                    textOut += " scope=";
+                    appendLogfmtValue(textOut, record.scope->data(), record.scope->size());
+                }
+
+                textOut += " thread=";
+                appendUnsigned(textOut, record.thread);
+                textOut += " msg=";
+                appendLogfmtValue(textOut, record.text, record.size);
+                appendLogfmtFields(textOut, record.fields);
+                textOut += '\n';
+            }
+
+#ifndef _WIN32
+            // Like JsonLayout.
+            void writeOnCrash(CrashFile&, const Record&) const {}
+#endif
+
+        private:
+            UtcTimestampCache mTimestamp;
+        };
+    }
+
+    // Writes records to a file, rendered by `Layout`, e.g. detail::TextLayout for FileOutput. The layout
+    // is a template parameter rather than a virtual function, such that writing a record involves no
+    // virtual call besides writeRecord() itself.
+    template <typename Layout>
+    class BasicFileOutput : public IOutput {
+    public:
+        BasicFileOutput(const char* filename) : BasicFileOutput{std::string{filename}} {}
+        BasicFileOutput(const std::string& filename) : mFile{filename}, mPath{filename} {
+            detail::CrashHandler::add(this);
+        }
+#ifdef _WIN32
+        BasicFileOutput(const std::wstring& filename) : mFile{filename} {}
+#endif
+
+// GCC <5 has a buggy std implementation where ostream does not have
+// a move constructor even though it should according to C++11 spec.
+// Without a file name, the crash handler can not write to the file.
+#if !defined(__GNUC__) || __GNUC__ >= 5
+        BasicFileOutput(std::ofstream&& file) : mFile{std::move(file)} {}
+#endif
+
+        virtual ~BasicFileOutput() {
+            detail::CrashHandler::remove(this);
+            mFlushTask.stop();
+            flush();
+        }
+
+        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+            writeRecord(makeRecord(scope, severity, line));
+        }
+
+        void writeRecord(const Record& record) override {
+            BasicFileOutput::writeBatch(&record, 1);
+        }
+
+        // The whole batch is formatted into one buffer and handed to the file in a single write.
+        void writeBatch(const Record* records, size_t count) override {
+            std::lock_guard<std::mutex> lock{mMutex};
+
+            for (size_t i = 0; i < count; ++i) {
+                mLayout.append(mPending.text, records[i]);
+                mPending.add(records[i].severity, mFlushPolicy);
+            }
+
+            if (mPending.isDue(mFlushPolicy)) {
+                writePending();
+            }
+        }
+
+        void flush() override {
+            std::lock_guard<std::mutex> lock{mMutex};
+            writePending();
+        }
+
+#ifndef _WIN32
+        void flushOnCrash() override { mCrash.flush(mPath, mPending.text); }
+
+        void writeRecordOnCrash(const Record& record) override {
+            flushOnCrash();
+            mLayout.writeOnCrash(mCrash, record);
+        }
+#endif
+
+        std::string name() const override { return mPath; }
+
+        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
+            detail::ScratchString text;
+            appendProgressBar(text.get(), current, total, duration, 80);
+            writeLine(scope, ESeverity::Progress, text.get());
+        }
+
+        // Defaults to FlushPolicy::buffered(8 * 1024), i.e. the buffering of a default std::ofstream.
+        void setFlushPolicy(const FlushPolicy& policy) {
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                mFlushPolicy = policy;
+            }
+
+            if (policy.interval.count() > 0) {
+                mFlushTask.start(policy.interval, [this]() { flush(); });
+            } else {
+                mFlushTask.stop();
+            }
+        }
+
+        FlushPolicy flushPolicy() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mFlushPolicy;
+        }
+
+    protected:
+        // Serializes writes of concurrent loggers. Guards the layout and everything below.
+        mutable std::mutex mMutex;
+        Layout mLayout;
+
+    private:
+        void writePending() {
+            if (!mPending.text.empty()) {
+                auto start = statsStart();
+                mFile.write(mPending.text.data(), (std::streamsize)mPending.text.size());
+                mFile.flush();
+                countFlush(mPending.text.size(), start);
+            }
+            mPending.reset();
+        }
+
+        std::ofstream mFile;
+        // Empty if the file was given as a stream.
+        std::string mPath;
+
+        FlushPolicy mFlushPolicy = FlushPolicy::buffered(8 * 1024);
+        detail::PendingText mPending;
+
+#ifndef _WIN32
+        detail::CrashFile mCrash;
+#endif
+
+        detail::PeriodicTask mFlushTask;
+    };
+
+    class FileOutput : public BasicFileOutput<detail::TextLayout> {
+    public:
+        using BasicFileOutput<detail::TextLayout>::BasicFileOutput;
+
+        void setTimePrecision(ETimePrecision precision) {
+            std::lock_guard<std::mutex> lock{mMutex};
+            mLayout.timestamp().setPrecision(precision);
+        }
+
+        ETimePrecision timePrecision() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mLayout.timestamp().precision();
+        }
+
+        // The layout of a line in a log file, shared with the other file-based outputs:
+        // HH:MM:SS [scope] SEVERITY text key=value...
+        static void appendLine(std::string& textOut, TimestampCache& timestamp, detail::PrefixCache& prefixes, const Record& record) {
+            detail::TextLayout::appendLine(textOut, timestamp, prefixes, record);
+        }
+
+        static void renderPrefix(std::string& textOut, const std::string& scope, ESeverity severity) {
+            detail::TextLayout::renderPrefix(textOut, scope, severity);
+        }
+    };
+
+    // Writes every record as one JSON object per line, e.g.
+    //     {"time":"2026-10-14T03:55:24.123456Z","severity":"info","scope":"db","thread":3,"message":"done","req":42}
+    // The scope is omitted if empty. Fields follow in the order in which they were added. Records are
+    // serialized straight into the pending text of the file, without building objects or strings for
+    // the fields. The crash handler writes the pending text, but skips records that outputs in front
+    // of this one, such as AsyncOutput, still held, as it can not render them without allocating.
+    class JsonOutput final : public BasicFileOutput<detail::JsonLayout> {
+    public:
+        using BasicFileOutput<detail::JsonLayout>::BasicFileOutput;
+    };
+
+    // Writes every record as one line of logfmt, e.g.
+    //     time=2026-10-14T03:55:24.123456Z level=info scope=db thread=3 msg=done req=42
+    // The scope is omitted if empty. Values are quoted where necessary. Like JsonOutput, the crash
+    // handler skips records held by outputs in front of this one.
+    class LogfmtOutput final : public BasicFileOutput<detail::LogfmtLayout> {
+    public:
+        using BasicFileOutput<detail::LogfmtLayout>::BasicFileOutput;
+    };
+
+#ifndef _WIN32
+    // Appends lines in the layout of FileOutput directly into a memory-mapped window of a file that
+    // is preallocated in large extents. Writing a line costs little more than a memcpy: a background
+    // thread maps the next extent ahead of time and writes back and unmaps finished ones, so the
+    // logging thread only makes system calls if it outpaces that thread. While the output is open,
+    // the file is padded with zeros up to the end of the current extent; it is truncated to the
+    // length of the written text when the output is destroyed. Not available on Windows.
+    class MmapFileOutput : public IOutput {
+    public:
+        MmapFileOutput(const std::string& filename, size_t extentSize = 16 * 1024 * 1024) : mPath{filename} {
+            size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+            mExtentSize = std::max(pageSize, (extentSize + pageSize - 1) / pageSize * pageSize);
+
+            mFd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (mFd < 0) {
+                throw std::runtime_error{"MmapFileOutput: could not open " + filename};
+            }
+
+            try {
+                mWindow = mapExtent(0);
+            } catch (...) {
+                ::close(mFd);
+                throw;
+            }
+
+            mNextIndex = 1;
+            mWorker = std::thread{[this]() { work(); }};
+        }
+
+        virtual ~MmapFileOutput() {
+            {
+                std::lock_guard<std::mutex> lock{mWorkerMutex};
+                mStopping = true;
+            }
+            mWorkerCv.notify_one();
+            mWorker.join();
+
+            unmap(mWindow);
+            unmap(mNext);
+            for (auto window : mRetired) {
+                unmap(window);
+            }
+
+            // Drop the preallocated but unused part of the file.
+            if (::ftruncate(mFd, (off_t)mSize) != 0) {}
+            ::close(mFd);
+        }
+
+        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+            writeRecord(makeRecord(scope, severity, line));
+        }
+
+        void writeRecord(const Record& record) override {
+            MmapFileOutput::writeBatch(&record, 1);
+        }
+
+        void writeBatch(const Record* records, size_t count) override {
+            std::lock_guard<std::mutex> lock{mMutex};
+
+            // Copying into the mapping is what hands the lines to the operating system.
+            auto start = statsStart();
+            size_t numBytes = 0;
+            for (size_t i = 0; i < count; ++i) {
+                mLine.clear();
+                FileOutput::appendLine(mLine, mTimestamp, mPrefixes, records[i]);
+                append(mLine.data(), mLine.size());
+                numBytes += mLine.size();
+            }
+            countFlush(numBytes, start);
+        }
+
+        std::string name() const override { return mPath; }
+
+        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
+            detail::ScratchString text;
+            appendProgressBar(text.get(), current, total, duration, 80);
+            writeLine(scope, ESeverity::Progress, text.get());
+        }
+
+        // The written text already lives in the page cache. This merely schedules its write-back.
+        void flush() override {
+            std::lock_guard<std::mutex> lock{mMutex};
+            ::msync(mWindow, mPos, MS_ASYNC);
+        }
+
+        void setTimePrecision(ETimePrecision precision) {
+            std::lock_guard<std::mutex> lock{mMutex};
+            mTimestamp.setPrecision(precision);
+        }
+
+        ETimePrecision timePrecision() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mTimestamp.precision();
+        }
+
+        // Number of bytes written so far
+        size_t size() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mSize;
+        }
+
+    private:
+        void append(const char* data, size_t size) {
+            while (size > 0) {
+                if (mPos == mExtentSize) {
+                    advance();
+                }
+
+                size_t n = std::min(size, mExtentSize - mPos);
+                std::memcpy(mWindow + mPos, data, n);
+                mPos += n;
+                mSize += n;
+                data += n;
+                size -= n;
+            }
+        }
+
+        // Moves on to the next extent, preferably one that the worker already mapped.
+        void advance() {
+            char* next = nullptr;
+            {
+                std::lock_guard<std::mutex> lock{mWorkerMutex};
+                if (mNext && mNextIndex == mExtentIndex + 1) {
+                    next = mNext;
+                    mNext = nullptr;
+                }
+            }
+
+            if (!next) {
+                next = mapExtent(mExtentIndex + 1);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{mWorkerMutex};
+                mRetired.push_back(mWindow);
+                mNextIndex = mExtentIndex + 2;
+            }
+            mWorkerCv.notify_one();
+
+            mWindow = next;
+            ++mExtentIndex;
+            mPos = 0;
+        }
+
+        char* mapExtent(size_t index) {
+            off_t offset = (off_t)(index * mExtentSize);
+#ifdef __linux__
+            int error = ::posix_fallocate(mFd, offset, (off_t)mExtentSize);
+#else
+            int error = ::ftruncate(mFd, offset + (off_t)mExtentSize);
+#endif
+            if (error != 0) {
+                throw std::runtime_error{"MmapFileOutput: could not allocate file extent."};
+            }
+
+            int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+            flags |= MAP_POPULATE;
+#endif
+            void* window = ::mmap(nullptr, mExtentSize, PROT_READ | PROT_WRITE, flags, mFd, offset);
+            if (window == MAP_FAILED) {
+                throw std::runtime_error{"MmapFileOutput: could not map file extent."};
+            }
+
+            return (char*)window;
+        }
+
+        void unmap(char* window) {
+            if (window) {
+                ::msync(window, mExtentSize, MS_ASYNC);
+                ::munmap(window, mExtentSize);
+            }
+        }
+
+        void work() {
+            std::unique_lock<std::mutex> lock{mWorkerMutex};
+            for (;;) {
+                if (!mRetired.empty()) {
+                    auto retired = std::move(mRetired);
+                    mRetired.clear();
+
+                    lock.unlock();
+                    for (auto window : retired) {
+                        unmap(window);
+                    }
+                    lock.lock();
+                    continue;
+                }
+
+                if (!mNext && mNextIndex != mPreparedIndex) {
+                    size_t index = mNextIndex;
+                    mPreparedIndex = index;
+
+                    lock.unlock();
+                    char* window = nullptr;
+                    try {
+                        window = mapExtent(index);
+                    } catch (...) {
+                        // The logging thread maps the extent itself and reports the error.
+                    }
+                    lock.lock();
+
+                    if (index == mNextIndex) {
+                        mNext = window;
+                    } else {
+                        // The logging thread did not wait for us and moved past this extent.
+                        lock.unlock();
+                        unmap(window);
+                        lock.lock();
+                    }
+                    continue;
+                }
+
+                if (mStopping) {
+                    break;
+                }
+
+                mWorkerCv.wait(lock);
+            }
+        }
+
+        std::string mPath;
+        int mFd = -1;
+        size_t mExtentSize;
+
+        // Serializes writes of concurrent loggers. Guards everything below.
+        mutable std::mutex mMutex;
+        TimestampCache mTimestamp;
+        detail::PrefixCache mPrefixes;
+        std::string mLine;
+        char* mWindow = nullptr;
+        size_t mExtentIndex = 0;
+        size_t mPos = 0;
+        size_t mSize = 0;
+
+        // Shared with the worker thread.
+        std::mutex mWorkerMutex;
+        std::condition_variable mWorkerCv;
+        char* mNext = nullptr;
+        size_t mNextIndex = 0;
+        size_t mPreparedIndex = 0;
+        std::vector<char*> mRetired;
+        bool mStopping = false;
+
+        std::thread mWorker;
+    };
+#endif
+
+    // A FileOutput that starts a new file once the current one reaches `maxSize` bytes or is `interval`
+    // old, whichever happens first; a limit of zero disables it. The active file is always `path`;
+    // older files are kept as `path.1` (the most recent) to `path.<maxFiles>` and deleted after that.
+    //
+    // Rotation itself is cheap for the logging thread: a background thread opens the next file ahead
+    // of time as `path.next`, and closes, renames and optionally compresses the finished one. If it is
+    // still busy with an earlier rotation, the logging thread opens the next file itself under a name of
+    // its own, `path.next.<n>`, rather than waiting. Next files left behind by a crash may hold the last
+    // records; an empty `path.next` is removed on start. `Compressor` turns `source` into `destination`
+    // and returns whether it succeeded, so e.g. zstd can be plugged in; define TLOG_USE_ZLIB and link
+    // zlib to get `gzip()`. Generations that failed to compress are kept, and shifted, uncompressed. On
+    // Windows, which can not rename open files, the logging thread renames the finished file itself and
+    // only compression happens in the background.
+    class RotatingFileOutput : public IOutput {
+    public:
+        struct Compressor {
+            std::string extension;
+            std::function<bool(const std::string& source, const std::string& destination)> compress;
+        };
+
+#ifdef TLOG_USE_ZLIB
+        static Compressor gzip(int level = 6) {
+            return {".gz", [level](const std::string& source, const std::string& destination) {
+                std::ifstream in{source, std::ios::binary};
+                gzFile out = gzopen(destination.c_str(), ("wb" + std::to_string(level)).c_str());
+                if (!in || !out) {
+                    if (out) {
+                        gzclose(out);
+                    }
+                    return false;
+                }
+
+                bool ok = true;
+                char buffer[64 * 1024];
+                while (ok && in) {
+                    in.read(buffer, sizeof(buffer));
+                    int n = (int)in.gcount();
+                    ok = n == 0 || gzwrite(out, buffer, (unsigned)n) == n;
+                }
+
+                return gzclose(out) == Z_OK && ok;
+            }};
+        }
+#endif
+
+        RotatingFileOutput(
+            const std::string& path,
+            size_t maxSize = 16 * 1024 * 1024,
+            std::chrono::seconds interval = std::chrono::seconds{0},
+            size_t maxFiles = 5,
+            Compressor compressor = Compressor{}
+        ) : mPath{path}, mMaxSize{maxSize}, mInterval{interval}, mMaxFiles{maxFiles}, mCompressor(std::move(compressor)) {
+            mFile = openFile(mPath, std::ios::app);
+            mFile->seekp(0, std::ios::end);
+            mSize = (size_t)mFile->tellp();
+            mNextRotation = std::chrono::system_clock::now() + mInterval;
+
+            std::ifstream next{nextPath(), std::ios::binary | std::ios::ate};
+            if (next.is_open() && next.tellg() == 0) {
+                next.close();
+                std::remove(nextPath().c_str());
+            }
+
+            mWorker = std::thread{[this]() { work(); }};
+            detail::CrashHandler::add(this);
+        }
+
+        virtual ~RotatingFileOutput() {
+            detail::CrashHandler::remove(this);
+            mFlushTask.stop();
+            flush();
+
+            {
+                std::lock_guard<std::mutex> lock{mWorkerMutex};
+                mStopping = true;
+            }
+            mWorkerCv.notify_one();
+            mWorker.join();
+
+            if (mNextFile) {
+                mNextFile.reset();
+                std::remove(nextPath().c_str());
+            }
+        }
+
+        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+            writeRecord(makeRecord(scope, severity, line));
+        }
+
+        void writeRecord(const Record& record) override {
+            RotatingFileOutput::writeBatch(&record, 1);
+        }
+
+        void writeBatch(const Record* records, size_t count) override {
+            std::lock_guard<std::mutex> lock{mMutex};
+
+            for (size_t i = 0; i < count; ++i) {
+                const Record& record = records[i];
+                if (mInterval.count() > 0 && record.time >= mNextRotation) {
+                    if (mSize + mPending.text.size() > 0) {
+                        rotateLocked();
+                    }
+                    mNextRotation = record.time + mInterval;
+                }
+
+                FileOutput::appendLine(mPending.text, mTimestamp, mPrefixes, record);
+                mPending.add(record.severity, mFlushPolicy);
+
+                if (mMaxSize > 0 && mSize + mPending.text.size() >= mMaxSize) {
+                    rotateLocked();
+                }
+            }
+
+            if (mPending.isDue(mFlushPolicy)) {
+                writePending();
+            }
+        }
+
+        void flush() override {
+            std::lock_guard<std::mutex> lock{mMutex};
+            writePending();
+        }
+
+#ifndef _WIN32
+        // Writes to the current file, even if the size limit is exceeded. Right after a rotation, it may
+        // still wait for the worker to rename it to `path`, which it may have done by now.
+        void flushOnCrash() override { mCrash.flush(mCurrentPath, mPending.text, mPath); }
+
+        void writeRecordOnCrash(const Record& record) override {
+            flushOnCrash();
+            mCrash.writeLine(record, mTimestamp, mPrefixes);
+        }
+#endif
+
+        std::string name() const override { return mPath; }
+
+        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
+            detail::ScratchString text;
+            appendProgressBar(text.get(), current, total, duration, 80);
+            writeLine(scope, ESeverity::Progress, text.get());
+        }
+
+        // Starts a new file right away, regardless of size and age of the current one.
+        void rotate() {
+            std::lock_guard<std::mutex> lock{mMutex};
+            rotateLocked();
+        }
+
+        void setTimePrecision(ETimePrecision precision) {
+            std::lock_guard<std::mutex> lock{mMutex};
+            mTimestamp.setPrecision(precision);
+        }
+
+        ETimePrecision timePrecision() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mTimestamp.precision();
+        }
+
+        // Defaults to FlushPolicy::buffered(8 * 1024) like FileOutput.
+        void setFlushPolicy(const FlushPolicy& policy) {
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                mFlushPolicy = policy;
+            }
+
+            if (policy.interval.count() > 0) {
+                mFlushTask.start(policy.interval, [this]() { flush(); });
+            } else {
+                mFlushTask.stop();
+            }
+        }
+
+        FlushPolicy flushPolicy() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mFlushPolicy;
+        }
+
+        const std::string& path() const {
+            return mPath;
+        }
+
+    private:
+        static std::unique_ptr<std::ofstream> openFile(const std::string& path, std::ios::openmode mode) {
+            std::unique_ptr<std::ofstream> file{new std::ofstream{path, std::ios::out | std::ios::binary | mode}};
+            if (!file->is_open()) {
+                throw std::runtime_error{"RotatingFileOutput: could not open " + path};
+            }
+            return file;
+        }
+
+        void writePending() {
+            if (!mPending.text.empty()) {
+                auto start = statsStart();
+                mFile->write(mPending.text.data(), (std::streamsize)mPending.text.size());
+                mFile->flush();
+                mSize += mPending.text.size();
+                countFlush(mPending.text.size(), start);
+            }
+            mPending.reset();
+        }
+
+        void rotateLocked() {
+            writePending();
+
+            std::unique_lock<std::mutex> lock{mWorkerMutex};
+#ifdef _WIN32
+            mWorkerIdleCv.wait(lock, [this]() { return mJobs.empty() && !mWorkerBusy; });
+            mFile.reset();
+            renameFiles();
+            mFile = openFile(mPath, std::ios::trunc);
+            mJobs.push_back(Job{nullptr, ""});
+#else
+            // The worker renames the next file to `path` once it has moved the finished one away. If it
+            // has not prepared one, because it is still busy with an earlier rotation or failed, open one
+            // of our own. Unless the worker is idle, `path.next` may still be waiting for its rename.
+            std::string successor = nextPath();
+            if (!mNextFile) {
+                if (!mJobs.empty() || mWorkerBusy) {
+                    successor += "." + std::to_string(++mNumInlineFiles);
+                }
+                mNextFile = openFile(successor, std::ios::trunc);
+            }
+
+            mJobs.push_back(Job{std::move(mFile), successor});
+            mFile = std::move(mNextFile);
+            mCurrentPath = successor;
+#endif
+            lock.unlock();
+            mWorkerCv.notify_one();
+
+            mSize = 0;
+        }
+
+        struct Job {
+            std::unique_ptr<std::ofstream> file;
+            // The file to rename to `path` once `file` is out of the way
+            std::string successor;
+        };
+
+        std::string generationPath(size_t generation, bool isCompressed = true) const {
+            return mPath + "." + std::to_string(generation) + (isCompressed ? mCompressor.extension : "");
+        }
+
+        std::string nextPath() const {
+            return mPath + ".next";
+        }
+
+        // Moves the finished file at `path` to `path.1`, shifting the older generations up by one. Files
+        // that failed to compress are shifted along with the compressed ones.
+        void renameFiles() {
+            if (mMaxFiles == 0) {
+                std::remove(mPath.c_str());
+                return;
+            }
+
+            bool hasCompressedNames = !mCompressor.extension.empty();
+            std::remove(generationPath(mMaxFiles).c_str());
+            if (hasCompressedNames) {
+                std::remove(generationPath(mMaxFiles, false).c_str());
+            }
+
+            for (size_t i = mMaxFiles - 1; i > 0; --i) {
+                std::rename(generationPath(i).c_str(), generationPath(i + 1).c_str());
+                if (hasCompressedNames) {
+                    std::rename(generationPath(i, false).c_str(), generationPath(i + 1, false).c_str());
+                }
+            }
+
+            std::rename(mPath.c_str(), generationPath(1, false).c_str());
+        }
+
+        // Runs on the worker thread.
+        void retire(Job job) {
+#ifndef _WIN32
+            job.file.reset();
+            renameFiles();
+            std::rename(job.successor.c_str(), mPath.c_str());
+
+            // Unless the logging thread rotated again in the meantime.
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                if (mCurrentPath == job.successor) {
+                    mCurrentPath = mPath;
+                }
+            }
+#else
+            (void)job;
+#endif
+
+            if (mMaxFiles > 0 && mCompressor.compress) {
+                std::string source = generationPath(1, false);
+                std::string destination = generationPath(1);
+
+                bool compressed = false;
+                try {
+                    compressed = mCompressor.compress(source, destination);
+                } catch (...) {}
+
+                // Keep the uncompressed file rather than losing it.
+                std::remove((compressed ? source : destination).c_str());
+            }
+        }
+
+        void prepareNextFile(std::unique_lock<std::mutex>& lock) {
+#ifndef _WIN32
+            mWorkerBusy = true;
+            lock.unlock();
+
+            std::unique_ptr<std::ofstream> file;
+            try {
+                file = openFile(nextPath(), std::ios::trunc);
+            } catch (...) {
+                // The logging thread tries again when it needs the file and reports any error.
+            }
+
+            lock.lock();
+            mNextFile = std::move(file);
+            mWorkerBusy = false;
+            mWorkerIdleCv.notify_all();
+#else
+            (void)lock;
+#endif
+        }
+
+        void work() {
+            std::unique_lock<std::mutex> lock{mWorkerMutex};
+            // A rotation that came first opened `path.next` itself.
+            if (mJobs.empty()) {
+                prepareNextFile(lock);
+            }
+
+            for (;;) {
+                if (!mJobs.empty()) {
+                    Job job = std::move(mJobs.front());
+                    mJobs.erase(mJobs.begin());
+                    mWorkerBusy = true;
+
+                    lock.unlock();
+                    retire(std::move(job));
+                    lock.lock();
+
+                    mWorkerBusy = false;
+                    mWorkerIdleCv.notify_all();
+
+                    if (mJobs.empty() && !mStopping) {
+                        prepareNextFile(lock);
+                    }
+                    continue;
+                }
+
+                if (mStopping) {
+                    break;
+                }
+
+                mWorkerCv.wait(lock);
+            }
+        }
+
+        const std::string mPath;
+        const size_t mMaxSize;
+        const std::chrono::seconds mInterval;
+        const size_t mMaxFiles;
+        const Compressor mCompressor;
+
+        // Serializes writes of concurrent loggers. Guards everything below.
+        mutable std::mutex mMutex;
+        std::unique_ptr<std::ofstream> mFile;
+        size_t mSize = 0;
+        std::chrono::system_clock::time_point mNextRotation;
+
+        TimestampCache mTimestamp;
+        detail::PrefixCache mPrefixes;
+
+        FlushPolicy mFlushPolicy = FlushPolicy::buffered(8 * 1024);
+        detail::PendingText mPending;
+
+#ifndef _WIN32
+        detail::CrashFile mCrash;
+        // The name of mFile, which differs from `path` until the worker renamed it after a rotation.
+        std::string mCurrentPath = mPath;
+#endif
+
+        // Shared with the worker thread.
+        std::mutex mWorkerMutex;
+        std::condition_variable mWorkerCv;
+        std::condition_variable mWorkerIdleCv;
+        std::vector<Job> mJobs;
+        std::unique_ptr<std::ofstream> mNextFile;
+        size_t mNumInlineFiles = 0;
+        bool mWorkerBusy = false;
+        bool mStopping = false;
+
+        std::thread mWorker;
+
+        detail::PeriodicTask mFlushTask;
+    };
+
+    // Writes records in a compact binary form instead of text. Binary records (see TLOG_BINARY) keep
+    // their arguments encoded, so no number is ever turned into text by the logging process; their
+    // format strings and scopes are written once per file and then referred to by id. Regular text
+    // records are stored verbatim, along with their fields. `decode()` and the tlog-decode tool turn
+    // such a file back into exactly the text a FileOutput would have written.
+    //
+    // The file starts with MAGIC, followed by entries that each start with an EEntry tag:
+    //   Format: id, severity, source line, source file, format string
+    //   Scope:  id, name
+    //   Binary: format id, scope id, time, encoded arguments
+    //   Text:   severity, scope id, time, text
+    //   Fields: severity, scope id, time, text, fields as encoded in Fields::data
+    // Integers are varints, times are zigzag-encoded nanoseconds since the epoch, and strings are
+    // prefixed by their length.
+    class BinaryFileOutput : public IOutput {
+    public:
+        enum EEntry : char {
+            Format = 'F',
+            Scope = 'S',
+            Binary = 'B',
+            Text = 'T',
+            // Text with fields. Files without them stay readable by decoders that predate fields.
+            FieldsText = 'K',
+        };
+
+        static const char* magic() { return "TLOGBIN1"; }
+
+        BinaryFileOutput(const std::string& filename) : mFile{filename, std::ios::out | std::ios::binary}, mPath{filename} {
+            if (!mFile.is_open()) {
+                throw std::runtime_error{"BinaryFileOutput: could not open " + filename};
+            }
+            mPending.text = magic();
+            detail::CrashHandler::add(this);
+        }
+
+        virtual ~BinaryFileOutput() {
+            detail::CrashHandler::remove(this);
+            mFlushTask.stop();
+            flush();
+        }
+
+        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+            writeRecord(makeRecord(scope, severity, line));
+        }
+
+        void writeRecord(const Record& record) override {
+            BinaryFileOutput::writeBatch(&record, 1);
+        }
+
+        void writeBatch(const Record* records, size_t count) override {
+            std::lock_guard<std::mutex> lock{mMutex};
+
+            for (size_t i = 0; i < count; ++i) {
+                const Record& record = records[i];
+                uint64_t scope = scopeId(*record.scope);
+
+                std::string& out = mPending.text;
+                out += (char)(record.fields.empty() ? Text : FieldsText);
+                out += (char)record.severity;
+                detail::appendVarint(out, scope);
+                appendTime(out, record.time);
+                detail::appendString(out, record.text, record.size);
+                if (!record.fields.empty()) {
+                    detail::appendString(out, record.fields.data, record.fields.size);
+                }
+
+                mPending.add(record.severity, mFlushPolicy);
+            }
+
+            if (mPending.isDue(mFlushPolicy)) {
+                writePending();
+            }
+        }
+
+        void writeBinary(const BinaryRecord& record) override {
+            std::lock_guard<std::mutex> lock{mMutex};
+
+            const EventFormat& format = *record.format;
+            defineFormat(format);
+            uint64_t scope = scopeId(*record.scope);
+
+            std::string& out = mPending.text;
+            out += (char)Binary;
+            detail::appendVarint(out, format.id());
+            detail::appendVarint(out, scope);
+            appendTime(out, record.time);
+            detail::appendString(out, record.args, record.size);
+
+            mPending.add(format.severity(), mFlushPolicy);
+            if (mPending.isDue(mFlushPolicy)) {
+                writePending();
+            }
+        }
+
+        void flush() override {
+            std::lock_guard<std::mutex> lock{mMutex};
+            writePending();
+        }
+
+#ifndef _WIN32
+        // Records that are handed over during the crash are not written, since new scopes and formats
+        // would have to be registered in the file.
+        void flushOnCrash() override { mCrash.flush(mPath, mPending.text); }
+#endif
+
+        std::string name() const override { return mPath; }
+
+        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
+            detail::ScratchString text;
+            appendProgressBar(text.get(), current, total, duration, 80);
+            writeLine(scope, ESeverity::Progress, text.get());
+        }
+
+        // Defaults to FlushPolicy::buffered(8 * 1024) like FileOutput.
+        void setFlushPolicy(const FlushPolicy& policy) {
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                mFlushPolicy = policy;
+            }
+
+            if (policy.interval.count() > 0) {
+                mFlushTask.start(policy.interval, [this]() { flush(); });
+            } else {
+                mFlushTask.stop();
+            }
+        }
+
+        FlushPolicy flushPolicy() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mFlushPolicy;
+        }
+
+        // Calls `callback` with every record of the binary log in `data`, rendered to text. Returns false
+        // if the data is not a binary log or is malformed, e.g. because the process died while writing
+        // it. All records up to that point are still reported.
+        static bool decode(const char* data, size_t size, const std::function<void(const Record&)>& callback) {
+            const char* it = data;
+            const char* end = data + size;
+
+            size_t magicSize = std::strlen(magic());
+            if (size < magicSize || std::memcmp(data, magic(), magicSize) != 0) {
+                return false;
+            }
+            it += magicSize;
+
+            struct DecodedFormat {
+                bool defined = false;
+                ESeverity severity = ESeverity::None;
+                std::string format;
+            };
+
+            std::vector<DecodedFormat> formats;
+            std::vector<std::string> scopes;
+            std::string text;
+
+            static const uint64_t MAX_ID = 1 << 24;
+
+            while (it != end) {
+                char tag = *it++;
+
+                uint64_t id, scope, severity, line;
+                int64_t nanoseconds;
+                const char* str;
+                size_t strSize;
+
+                switch (tag) {
+                    case Format: {
+                        if (!detail::readVarint(it, end, id)
+                            || id >= MAX_ID
+                            || !detail::readVarint(it, end, severity)
+                            || !detail::readVarint(it, end, line)
+                            || !detail::readString(it, end, str, strSize) // Source file
+                            || !detail::readString(it, end, str, strSize)
+                        ) {
+                            return false;
+                        }
+
+                        if (formats.size() <= id) {
+                            formats.resize((size_t)id + 1);
+                        }
+                        formats[(size_t)id].defined = true;
+                        formats[(size_t)id].severity = (ESeverity)severity;
+                        formats[(size_t)id].format.assign(str, strSize);
+                        break;
+                    }
+                    case Scope:
+                        if (!detail::readVarint(it, end, id) || id != scopes.size() || !detail::readString(it, end, str, strSize)) {
+                            return false;
+                        }
+                        scopes.emplace_back(str, strSize);
+                        break;
+                    case Binary: {
+                        if (!detail::readVarint(it, end, id)
+                            || id >= formats.size()
+                            || !formats[(size_t)id].defined
+                            || !detail::readVarint(it, end, scope)
+                            || scope >= scopes.size()
+                            || !readTime(it, end, nanoseconds)
+                            || !detail::readString(it, end, str, strSize)
+                        ) {
+                            return false;
+                        }
+
+                        const DecodedFormat& format = formats[(size_t)id];
+                        text.clear();
+                        if (!detail::renderBinary(text, format.format.c_str(), str, strSize)) {
+                            return false;
+                        }
+
+                        callback({format.severity, &scopes[(size_t)scope], text.data(), text.size(), toTime(nanoseconds), 0, {}});
+                        break;
+                    }
+                    case Text:
+                    case FieldsText: {
+                        if (it == end) {
+                            return false;
+                        }
+                        severity = (uint8_t)*it++;
+                        if (!detail::readVarint(it, end, scope)
+                            || scope >= scopes.size()
+                            || !readTime(it, end, nanoseconds)
+                            || !detail::readString(it, end, str, strSize)
+                        ) {
+                            return false;
+                        }
+
+                        Fields fields = {nullptr, 0};
+                        if (tag == FieldsText && (!detail::readString(it, end, fields.data, fields.size) || !areValidFields(fields))) {
+                            return false;
+                        }
+
+                        callback({(ESeverity)severity, &scopes[(size_t)scope], str, strSize, toTime(nanoseconds), 0, fields});
+                        break;
+                    }
+                    default:
+                        return false;
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        static void appendTime(std::string& out, std::chrono::system_clock::time_point time) {
+            auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+            detail::appendVarint(out, detail::zigzag(nanoseconds));
+        }
+
+        static bool readTime(const char*& it, const char* end, int64_t& nanoseconds) {
+            uint64_t value;
+            if (!detail::readVarint(it, end, value)) {
+                return false;
+            }
+            nanoseconds = detail::unzigzag(value);
+            return true;
+        }
+
+        // Fields::forEach() trusts its input; files may be truncated or corrupt.
+        static bool areValidFields(const Fields& fields) {
+            size_t pos = 0;
+            while (pos < fields.size) {
+                ++pos;
+                for (int i = 0; i < 2; ++i) {
+                    uint32_t size32;
+                    if (fields.size - pos < 4) {
+                        return false;
+                    }
+                    std::memcpy(&size32, fields.data + pos, 4);
+                    pos += 4;
+                    if (fields.size - pos < size32) {
+                        return false;
+                    }
+                    pos += size32;
+                }
+            }
+            return true;
+        }
+
+        static std::chrono::system_clock::time_point toTime(int64_t nanoseconds) {
+            return std::chrono::system_clock::time_point{
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds{nanoseconds})
+            };
+        }
+
+        void defineFormat(const EventFormat& format) {
+            if (format.id() < mDefinedFormats.size() && mDefinedFormats[format.id()]) {
+                return;
+            }
+
+            if (mDefinedFormats.size() <= format.id()) {
+                mDefinedFormats.resize(format.id() + 1);
+            }
+            mDefinedFormats[format.id()] = true;
+
+            std::string& out = mPending.text;
+            out += (char)Format;
+            detail::appendVarint(out, format.id());
+            detail::appendVarint(out, (uint64_t)format.severity());
+            detail::appendVarint(out, format.line());
+            detail::appendString(out, format.file(), std::strlen(format.file()));
+            detail::appendString(out, format.format(), std::strlen(format.format()));
+        }
+
+        uint64_t scopeId(const std::string& scope) {
+            // Consecutive records mostly come from the same logger.
+            if (mLastScopeId < mScopes.size() && *mLastScope == scope) {
+                return mLastScopeId;
+            }
+
+            auto inserted = mScopes.insert(std::make_pair(scope, (uint64_t)mScopes.size()));
+            if (inserted.second) {
+                std::string& out = mPending.text;
+                out += (char)Scope;
+                detail::appendVarint(out, inserted.first->second);
+                detail::appendString(out, scope.data(), scope.size());
+            }
+
+            mLastScope = &inserted.first->first;
+            mLastScopeId = inserted.first->second;
+            return mLastScopeId;
+        }
+
+        void writePending() {
+            if (!mPending.text.empty()) {
+                auto start = statsStart();
+                mFile.write(mPending.text.data(), (std::streamsize)mPending.text.size());
+                mFile.flush();
+                countFlush(mPending.text.size(), start);
+            }
+            mPending.reset();
+        }
+
+        std::ofstream mFile;
+        std::string mPath;
+
+        // Serializes writes of concurrent loggers. Guards everything below.
+        mutable std::mutex mMutex;
+
+        std::vector<bool> mDefinedFormats;
+        std::map<std::string, uint64_t> mScopes;
+        const std::string* mLastScope = nullptr;
+        uint64_t mLastScopeId = (uint64_t)-1;
+
+        FlushPolicy mFlushPolicy = FlushPolicy::buffered(8 * 1024);
+        detail::PendingText mPending;
+
+#ifndef _WIN32
+        detail::CrashFile mCrash;
+#endif
+
+        detail::PeriodicTask mFlushTask;
+    };
+
+
+    namespace detail {
+        // Bounded lock-free queue after Dmitry Vyukov's design. Every slot carries a sequence number
+        // that tells producers and consumers whether it is free or filled, so that any number of
+        // threads may push and pop concurrently without taking a lock.
+        template <typename T>
+        class BoundedQueue {
+        public:
+            BoundedQueue(size_t capacity) {
+                size_t size = 2;
+                while (size < capacity) {
+                    size *= 2;
+                }
+
+                mSlots = std::unique_ptr<Slot[]>(new Slot[size]);
+                mMask = size - 1;
+                for (size_t i = 0; i < size; ++i) {
+                    mSlots[i].sequence.store(i, std::memory_order_relaxed);
+                }
+
+                mEnqueuePos.store(0, std::memory_order_relaxed);
+                mDequeuePos.store(0, std::memory_order_relaxed);
+            }
+
+            // Claims a free slot and lets `fill` write into it. Returns false if the queue is full.
+            template <typename F>
+            bool tryPush(F&& fill) {
+                Slot* slot;
+                size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+                for (;;) {
+                    slot = &mSlots[pos & mMask];
+                    size_t seq = slot->sequence.load(std::memory_order_acquire);
+                    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                    if (diff == 0) {
+                        if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                            break;
+                        }
+                    } else if (diff < 0) {
+                        return false;
+                    } else {
+                        pos = mEnqueuePos.load(std::memory_order_relaxed);
+                    }
+                }
+
+                fill(slot->value);
+                slot->sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+
+            // Claims the oldest filled slot and lets `consume` read from it. Returns false if the queue is empty.
+            template <typename F>
+            bool tryPop(F&& consume) {
+                Slot* slot;
+                size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+                for (;;) {
+                    slot = &mSlots[pos & mMask];
+                    size_t seq = slot->sequence.load(std::memory_order_acquire);
+                    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+                    if (diff == 0) {
+                        if (mDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                            break;
+                        }
+                    } else if (diff < 0) {
+                        return false;
+                    } else {
+                        pos = mDequeuePos.load(std::memory_order_relaxed);
+                    }
+                }
+
+                consume(slot->value);
+                slot->sequence.store(pos + mMask + 1, std::memory_order_release);
+                return true;
+            }
+
+            bool empty() const {
+                return size() == 0;
+            }
+
+            size_t size() const {
+                size_t dequeuePos = mDequeuePos.load(std::memory_order_acquire);
+                size_t enqueuePos = mEnqueuePos.load(std::memory_order_acquire);
+                return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+            }
+
+            size_t capacity() const { return mMask + 1; }
+
+            // Total number of slots ever claimed by producers.
+            size_t numPushed() const { return mEnqueuePos.load(std::memory_order_acquire); }
+
+        private:
+            struct Slot {
+                std::atomic<size_t> sequence;
+                T value;
+            };
+
+            std::unique_ptr<Slot[]> mSlots;
+            size_t mMask;
+
+            // Keep producers and consumers from invalidating each other's cache lines.
+            char mPad0[64];
+            std::atomic<size_t> mEnqueuePos;
+            char mPad1[64];
+            std::atomic<size_t> mDequeuePos;
+            char mPad2[64];
+        };
+    }
+
+    enum class EOverflowPolicy {
+        // Wait for the worker to make room. No record is ever lost.
+        Block,
+        // Discard the record that does not fit.
+        DropNewest,
+        // Discard the oldest queued record to make room for the new one.
+        DropOldest,
+    };
+
+    // Decouples the logging threads from slow outputs: records are placed into a bounded
+    // lock-free queue and a background worker hands them to the wrapped outputs.
+    class AsyncOutput : public IOutput {
+    public:
+        // Records are handed to the outputs in the given order. Duplicates are ignored.
+        AsyncOutput(
+            const std::vector<std::shared_ptr<IOutput>>& outputs = {ConsoleOutput::global()},
+            size_t capacity = 8192,
+            EOverflowPolicy overflowPolicy = EOverflowPolicy::Block
+        ) : mOutputs{detail::uniqueOutputs(outputs)}, mQueue{capacity}, mOverflowPolicy{overflowPolicy} {
+            mWorker = std::thread{[this]() { work(); }};
+            detail::CrashHandler::add(this);
+        }
+
+        // Outputs given as a set are ordered by their address. A template, such that braced lists pick the vector.
+        template <typename Compare, typename Allocator>
+        AsyncOutput(
+            const std::set<std::shared_ptr<IOutput>, Compare, Allocator>& outputs,
+            size_t capacity = 8192,
+            EOverflowPolicy overflowPolicy = EOverflowPolicy::Block
+        ) : AsyncOutput(std::vector<std::shared_ptr<IOutput>>(outputs.begin(), outputs.end()), capacity, overflowPolicy) {}
+
+        virtual ~AsyncOutput() {
+            detail::CrashHandler::remove(this);
+            shutdown();
+        }
+
+        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+            writeRecord(makeRecord(scope, severity, line));
+        }
+
+        void writeRecord(const Record& record) override {
+            // Assigning into the slot reuses its capacity, so steady-state logging does not allocate.
+            bool isQueued = push([&](Entry& entry) {
+                entry.isProgress = false;
+                entry.format = nullptr;
+                entry.severity = record.severity;
+                entry.time = record.time;
+                entry.thread = record.thread;
+                entry.scope.assign(*record.scope);
+                entry.line.assign(record.text, record.size);
+                entry.fields.assign(record.fields.data, record.fields.size);
+            });
+
+            if (!isQueued) {
+                for (auto& output : mOutputs) {
+                    output->timedWriteRecord(record);
+                }
+            }
+        }
+
+        // The arguments stay encoded until the worker hands them to the outputs.
+        void writeBinary(const BinaryRecord& record) override {
+            bool isQueued = push([&](Entry& entry) {
+                entry.isProgress = false;
+                entry.format = record.format;
+                entry.severity = record.format->severity();
+                entry.time = record.time;
+                entry.thread = record.thread;
+                entry.scope.assign(*record.scope);
+                entry.line.assign(record.args, record.size);
+                entry.fields.clear();
+            });
+
+            if (!isQueued) {
+                for (auto& output : mOutputs) {
+                    output->timedWriteBinary(record);
+                }
+            }
+        }
+
+        bool defersRendering() const override { return true; }
+
+        // The worker renders the text. Copying the function allocates unless its captures are small.
+        void writeDeferred(const DeferredRecord& record) override {
+            bool isQueued = push([&](Entry& entry) {
+                entry.isProgress = false;
+                entry.format = nullptr;
+                entry.severity = record.severity;
+                entry.time = record.time;
+                entry.thread = record.thread;
+                entry.scope.assign(*record.scope);
+                entry.line.clear();
+                entry.fields.clear();
+                entry.render = *record.render;
+            });
+
+            if (!isQueued) {
+                for (auto& output : mOutputs) {
+                    output->timedWriteDeferred(record);
+                }
+            }
+        }
+
+        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
+            // Report invalid progress to the caller rather than failing on the worker thread.
+            checkProgress(current, total);
+
+            bool isQueued = push([&](Entry& entry) {
+                entry.isProgress = true;
+                entry.severity = ESeverity::Progress;
+                entry.scope.assign(scope);
+                entry.current = current;
+                entry.total = total;
+                entry.duration = duration;
+            });
+
+            if (!isQueued) {
+                for (auto& output : mOutputs) {
+                    output->writeProgress(scope, current, total, duration);
+                }
+            }
+        }
+
+        // Blocks until all records queued before the call have been handed to the outputs, then flushes them.
+        void flush() override {
+            size_t target = mQueue.numPushed();
+
+            std::unique_lock<std::mutex> lock{mMutex};
+            ++mNumFlushing;
+            while (mNumCompleted.load() < target && !mStopped.load()) {
+                mWakeCv.notify_one();
+                mDrainedCv.wait_for(lock, std::chrono::milliseconds{1});
+            }
+            --mNumFlushing;
+            lock.unlock();
+
+            for (auto& output : mOutputs) {
+                output->flush();
+            }
+        }
+
+        // Writes all queued records and stops the worker. Records that arrive afterwards, or that
+        // are blocked on a full queue, are written synchronously on the calling thread.
+        void shutdown() {
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                if (mStopping) {
+                    return;
+                }
+                mStopping = true;
+            }
+
+            mWakeCv.notify_one();
+            if (mWorker.joinable()) {
+                mWorker.join();
+            }
+
+            mStopped.store(true);
+
+            // Pick up the records of producers that raced with the worker's final drain. Producers
+            // that see mStopped write synchronously, so this terminates.
+            while (mNumPushing.load() > 0) {
+                std::this_thread::yield();
+            }
+            while (drain() > 0) {}
+
+            for (auto& output : mOutputs) {
+                output->flush();
+            }
+        }
+
+#ifndef _WIN32
+        // Hands the queued records to the outputs, after their own pending text. The worker gets a moment
+        // to finish the batch it is busy with, unless it is the thread that crashed. Binary records are
+        // written as their bare format string, since rendering their arguments allocates, and deferred
+        // records without text for the same reason. Progress is skipped.
+        void flushOnCrash() override {
+            if (mFlushedOnCrash.exchange(true)) {
+                return;
+            }
+
+            mCrashing.store(true);
+            for (int i = 0; i < 100 && mDraining.load(); ++i) {
+                struct timespec delay = {0, 1000 * 1000};
+                nanosleep(&delay, nullptr);
+            }
+
+            for (auto& output : mOutputs) {
+                output->flushOnCrash();
+            }
+
+            // Popping only touches atomics and leaves the entry's strings in place.
+            while (mQueue.tryPop([this](Entry& entry) {
+                if (entry.isProgress) {
+                    return;
+                }
+
+                Record record = {entry.severity, &entry.scope, entry.line.data(), entry.line.size(), entry.time, entry.thread, {entry.fields.data(), entry.fields.size()}};
+                if (entry.format) {
+                    record.text = entry.format->format();
+                    record.size = std::strlen(record.text);
+                }
+
+                for (auto& output : mOutputs) {
+                    output->writeRecordOnCrash(record);
+                }
+            })) {}
+        }
+
+        void writeRecordOnCrash(const Record& record) override {
+            flushOnCrash();
+            for (auto& output : mOutputs) {
+                output->writeRecordOnCrash(record);
+            }
+        }
+#endif
+
+        // Number of records discarded because the queue was full.
+        uint64_t numDropped() const { return mNumDropped.load(std::memory_order_relaxed); }
+
+        // Number of records currently waiting for the worker.
+        size_t queueSize() const { return mQueue.size(); }
+        size_t capacity() const { return mQueue.capacity(); }
+
+        EOverflowPolicy overflowPolicy() const { return mOverflowPolicy; }
+
+        std::string name() const override { return "async"; }
+
+        // The high-water mark of the queue is only tracked while stats are enabled.
+        OutputStats stats() const override {
+            OutputStats result = IOutput::stats();
+            result.queueSize = queueSize();
+            result.queueHighWater = mQueueHighWater.load(std::memory_order_relaxed);
+            result.numDropped = numDropped();
+            return result;
+        }
+
+        const std::vector<std::shared_ptr<IOutput>>& outputs() const { return mOutputs; }
+
+    private:
+        struct Entry {
+            bool isProgress = false;
+            // Set for binary records, whose encoded arguments are stored in `line`.
+            const EventFormat* format = nullptr;
+            // Set for deferred records until the worker has rendered them into `line`.
+            std::function<void(std::string&)> render;
+            ESeverity severity = ESeverity::None;
+            std::string scope;
+            std::string line;
+            std::string fields;
+            uint64_t current = 0;
+            uint64_t total = 0;
+            duration_t duration;
+            std::chrono::system_clock::time_point time;
+            unsigned thread = 0;
+        };
+
+        // Returns false once the worker is stopped, in which case the caller writes the record itself.
+        template <typename F>
+        bool push(F&& fill) {
+            // Pairs with shutdown(): either it waits for us or we see mStopped.
+            mNumPushing.fetch_add(1);
+            if (mStopped.load()) {
+                mNumPushing.fetch_sub(1);
+                return false;
+            }
+
+            if (!mQueue.tryPush(fill)) {
+                switch (mOverflowPolicy) {
+                    case EOverflowPolicy::DropNewest:
+                        mNumDropped.fetch_add(1, std::memory_order_relaxed);
+                        mNumPushing.fetch_sub(1);
+                        return true;
+                    case EOverflowPolicy::DropOldest:
+                        do {
+                            if (mQueue.tryPop([](Entry& entry) { entry.render = nullptr; })) {
+                                mNumDropped.fetch_add(1, std::memory_order_relaxed);
+                                mNumCompleted.fetch_add(1);
+                            }
+                        } while (!mQueue.tryPush(fill));
+                        break;
+                    case EOverflowPolicy::Block:
+                        do {
+                            if (mStopped.load()) {
+                                mNumPushing.fetch_sub(1);
+                                return false;
+                            }
+                            wakeWorker();
+                            std::this_thread::yield();
+                        } while (!mQueue.tryPush(fill));
+                        break;
+                }
+            }
+
+            if (statsEnabled()) {
+                size_t size = mQueue.size();
+                size_t highWater = mQueueHighWater.load(std::memory_order_relaxed);
+                while (size > highWater && !mQueueHighWater.compare_exchange_weak(highWater, size, std::memory_order_relaxed)) {}
+            }
+
+            // Pairs with the fence in work(): either the worker sees the new record or we see it sleeping.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (mWorkerSleeping.load(std::memory_order_relaxed)) {
+                wakeWorker();
+            }
+
+            mNumPushing.fetch_sub(1);
+            return true;
+        }
+
+        void wakeWorker() {
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+            }
+            mWakeCv.notify_one();
+        }
+
+        // There is nobody to report errors to on the worker thread. Skip records rather than terminating.
+        void writeProgress(const Entry& entry) {
+            for (auto& output : mOutputs) {
+                try {
+                    output->writeProgress(entry.scope, entry.current, entry.total, entry.duration);
+                } catch (...) {}
+            }
+        }
+
+        // Also releases the captures of the function.
+        static void render(Entry& entry) {
+            try {
+                entry.render(entry.line);
+            } catch (...) {}
+            entry.render = nullptr;
+        }
+
+        void writeBinary(const Entry& entry) {
+            BinaryRecord record = {entry.format, &entry.scope, entry.line.data(), entry.line.size(), entry.time, entry.thread};
+            for (auto& output : mOutputs) {
+                try {
+                    output->timedWriteBinary(record);
+                } catch (...) {}
+            }
+        }
+
+        void writeBatch(size_t count) {
+            if (count == 0) {
+                return;
+            }
+
+            for (auto& output : mOutputs) {
+                try {
+                    output->timedWriteBatch(mRecords.data(), count);
+                } catch (...) {}
+            }
+        }
+
+        // Pops up to MAX_BATCH_SIZE records and hands them to the outputs in batches.
+        size_t drain() {
+            // Pairs with flushOnCrash(), which waits for the records in flight and keeps us from popping more.
+            mDraining.store(true);
+
+            size_t numPopped = 0;
+            size_t numBatched = 0;
+            while (numPopped < MAX_BATCH_SIZE && !mCrashing.load() && mQueue.tryPop([&](Entry& entry) { std::swap(entry, mBatch[numBatched]); })) {
+                ++numPopped;
+
+                auto& entry = mBatch[numBatched];
+                if (entry.isProgress) {
+                    // Keep the order of lines, progress updates and binary records intact.
+                    writeBatch(numBatched);
+                    numBatched = 0;
+                    writeProgress(entry);
+                } else if (entry.format) {
+                    writeBatch(numBatched);
+                    numBatched = 0;
+                    writeBinary(entry);
+                } else {
+                    if (entry.render) {
+                        render(entry);
+                    }
+                    mRecords[numBatched] = {entry.severity, &entry.scope, entry.line.data(), entry.line.size(), entry.time, entry.thread, {entry.fields.data(), entry.fields.size()}};
+                    ++numBatched;
+                }
+            }
+
+            writeBatch(numBatched);
+            mDraining.store(false);
+
+            mNumCompleted.fetch_add(numPopped);
+
+            if (numPopped > 0) {
+                std::lock_guard<std::mutex> lock{mMutex};
+                if (mNumFlushing > 0) {
+                    mDrainedCv.notify_all();
+                }
+            }
+
+            return numPopped;
+        }
+
+        void work() {
+            for (;;) {
+                if (drain() > 0) {
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock{mMutex};
+                mWorkerSleeping.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                if (mQueue.empty()) {
+                    if (mStopping) {
+                        mWorkerSleeping.store(false, std::memory_order_relaxed);
+                        break;
+                    }
+
+                    // The timeout is a safety net only; producers wake us explicitly.
+                    mWakeCv.wait_for(lock, std::chrono::milliseconds{100});
+                }
+
+                mWorkerSleeping.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        std::vector<std::shared_ptr<IOutput>> mOutputs;
+        detail::BoundedQueue<Entry> mQueue;
+        EOverflowPolicy mOverflowPolicy;
+
+        static const size_t MAX_BATCH_SIZE = 256;
+
+        // Only touched by the thread that is currently draining the queue.
+        std::vector<Entry> mBatch = std::vector<Entry>(MAX_BATCH_SIZE);
+        std::vector<Record> mRecords = std::vector<Record>(MAX_BATCH_SIZE);
+
+        std::atomic<uint64_t> mNumDropped{0};
+        std::atomic<size_t> mQueueHighWater{0};
+        std::atomic<size_t> mNumCompleted{0};
+        std::atomic<bool> mWorkerSleeping{false};
+        std::atomic<bool> mStopped{false};
+        // Producers between their check of mStopped and the end of their push.
+        std::atomic<int> mNumPushing{0};
+        std::atomic<bool> mFlushedOnCrash{false};
+        std::atomic<bool> mCrashing{false};
+        std::atomic<bool> mDraining{false};
+
+        std::mutex mMutex;
+        std::condition_variable mWakeCv;
+        std::condition_variable mDrainedCv;
+        int mNumFlushing = 0;
+        bool mStopping = false;
+
+        std::thread mWorker;
+    };
+
+    // Lets every thread collect records in a buffer of its own and hand them to the wrapped outputs in
+    // whole chunks, as decided by a FlushPolicy. By default, a chunk is written once it reaches 64 KiB,
+    // after 100 ms, or right away when it contains a warning or an error. Threads only synchronize with
+    // each other when a chunk is written, so hot loops on many cores do not contend on the outputs.
+    //
+    // Chunks of different threads are written in the order they fill up, not in the order of their
+    // records. The records of each thread keep their order and get strictly increasing timestamps, so
+    // lines of a merged file can be sorted afterwards, e.g. after FileOutput::setTimePrecision(ETimePrecision::Nanoseconds).
+    // Progress bars bypass the buffer.
+    class ThreadBufferedOutput : public IOutput {
+    public:
+        // Chunks are handed to the outputs in the given order. Duplicates are ignored.
+        ThreadBufferedOutput(
+            const std::vector<std::shared_ptr<IOutput>>& outputs = {ConsoleOutput::global()},
+            FlushPolicy policy = defaultPolicy()
+        ) : mOutputs{detail::uniqueOutputs(outputs)}, mPolicy{policy}, mId{nextId()} {
+            if (mPolicy.interval.count() > 0) {
+                mFlushTask.start(mPolicy.interval, [this]() { flushBuffers(false); });
+            }
+            detail::CrashHandler::add(this);
+        }
+
+        // Outputs given as a set are ordered by their address. A template, such that braced lists pick the vector.
+        template <typename Compare, typename Allocator>
+        ThreadBufferedOutput(const std::set<std::shared_ptr<IOutput>, Compare, Allocator>& outputs, FlushPolicy policy = defaultPolicy())
+        : ThreadBufferedOutput(std::vector<std::shared_ptr<IOutput>>(outputs.begin(), outputs.end()), policy) {}
+
+        virtual ~ThreadBufferedOutput() {
+            detail::CrashHandler::remove(this);
+            mFlushTask.stop();
+
+            for (auto& buffer : buffers()) {
+                std::lock_guard<std::mutex> lock{buffer->mutex};
+                writeChunk(*buffer);
+                buffer->owner = nullptr;
+                buffer->closed.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+            writeRecord(makeRecord(scope, severity, line));
+        }
+
+        void writeRecord(const Record& record) override {
+            Buffer& buffer = localBuffer();
+            std::lock_guard<std::mutex> lock{buffer.mutex};
+            append(buffer, record);
+
+            if (buffer.pending.isDue(mPolicy)) {
+                writeChunk(buffer);
+            }
+        }
+
+        void writeBatch(const Record* records, size_t count) override {
+            Buffer& buffer = localBuffer();
+            std::lock_guard<std::mutex> lock{buffer.mutex};
+            for (size_t i = 0; i < count; ++i) {
+                append(buffer, records[i]);
+            }
+
+            if (buffer.pending.isDue(mPolicy)) {
+                writeChunk(buffer);
+            }
+        }
+
+        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
+            {
+                // Keep progress bars after the lines this thread logged before them.
+                Buffer& buffer = localBuffer();
+                std::lock_guard<std::mutex> lock{buffer.mutex};
+                writeChunk(buffer);
+            }
+
+            for (auto& output : mOutputs) {
+                output->writeProgress(scope, current, total, duration);
+            }
+        }
+
+        // Writes the buffers of all threads, then flushes the outputs.
+        void flush() override {
+            flushBuffers(true);
+            for (auto& output : mOutputs) {
+                output->flush();
+            }
+        }
+
+#ifndef _WIN32
+        // Hands the buffers of all threads to the outputs, one thread after the other.
+        void flushOnCrash() override {
+            if (mFlushedOnCrash.exchange(true)) {
+                return;
+            }
+
+            for (auto& output : mOutputs) {
+                output->flushOnCrash();
+            }
+
+            for (auto& buffer : mBuffers) {
+                for (auto& entry : buffer->entries) {
+                    Record record = recordOf(*buffer, entry);
+                    for (auto& output : mOutputs) {
+                        output->writeRecordOnCrash(record);
+                    }
+                }
+            }
+        }
+
+        void writeRecordOnCrash(const Record& record) override {
+            flushOnCrash();
+            for (auto& output : mOutputs) {
+                output->writeRecordOnCrash(record);
+            }
+        }
+#endif
+
+        std::string name() const override { return "thread-buffered"; }
+
+        const std::vector<std::shared_ptr<IOutput>>& outputs() const { return mOutputs; }
+
+    private:
+        struct Entry {
+            ESeverity severity;
+            size_t scope;
+            // The fields follow the text.
+            size_t text;
+            size_t size;
+            size_t fieldsSize;
+            std::chrono::system_clock::time_point time;
+            unsigned thread;
+        };
+
+        struct Buffer {
+            // Only contended while a chunk of this thread is written by another one, e.g. by flush().
+            std::mutex mutex;
+            ThreadBufferedOutput* owner;
+            std::atomic<bool> closed{false};
+
+            // The texts of all entries, along with what the FlushPolicy checks, and their distinct
+            // consecutive scopes. The strings retain their capacity across chunks.
+            detail::PendingText pending;
+            std::vector<std::string> scopes;
+            size_t numScopes = 0;
+            std::vector<Entry> entries;
+            std::vector<Record> records;
+
+            std::chrono::system_clock::time_point lastTime;
+        };
+
+        // Buffers of the calling thread, for all ThreadBufferedOutputs it logged to. Once the thread
+        // exits, they are written and unregistered from their outputs.
+        struct ThreadBuffers {
+            std::vector<std::pair<uint64_t, std::shared_ptr<Buffer>>> buffers;
+
+            ~ThreadBuffers() {
+                for (auto& entry : buffers) {
+                    auto& buffer = entry.second;
+                    std::lock_guard<std::mutex> lock{buffer->mutex};
+                    if (buffer->owner) {
+                        try {
+                            buffer->owner->writeChunk(*buffer);
+                        } catch (...) {}
+                        buffer->owner->unregister(buffer.get());
+                    }
+                }
+            }
+        };
+
+        static uint64_t nextId() {
+            static std::atomic<uint64_t> id{0};
+            return id++;
+        }
+
+        static FlushPolicy defaultPolicy() {
+            return FlushPolicy::onSeverity(
+                severityMask(ESeverity::Warning) | severityMask(ESeverity::Error),
+                64 * 1024,
+                std::chrono::milliseconds{100}
+            );
+        }
+
+        Buffer& localBuffer() {
+            static thread_local ThreadBuffers threadBuffers;
+            auto& buffers = threadBuffers.buffers;
+            for (auto& entry : buffers) {
+                if (entry.first == mId) {
+                    return *entry.second;
+                }
+            }
+
+            // Forget buffers of outputs that no longer exist.
+            buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [](const std::pair<uint64_t, std::shared_ptr<Buffer>>& entry) {
+                return entry.second->closed.load(std::memory_order_relaxed);
+            }), buffers.end());
+
+            std::shared_ptr<Buffer> buffer{new Buffer};
+            buffer->owner = this;
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                mBuffers.push_back(buffer);
+            }
+
+            buffers.emplace_back(mId, buffer);
+            return *buffer;
+        }
+
+        std::vector<std::shared_ptr<Buffer>> buffers() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mBuffers;
+        }
+
+        void unregister(Buffer* buffer) {
+            std::lock_guard<std::mutex> lock{mMutex};
+            mBuffers.erase(std::remove_if(mBuffers.begin(), mBuffers.end(), [buffer](const std::shared_ptr<Buffer>& other) {
+                return other.get() == buffer;
+            }), mBuffers.end());
+        }
+
+        // Requires the buffer's lock.
+        void append(Buffer& buffer, const Record& record) {
+            // Consecutive records mostly share their scope, so it is only stored when it changes.
+            if (buffer.numScopes == 0 || buffer.scopes[buffer.numScopes - 1] != *record.scope) {
+                if (buffer.scopes.size() == buffer.numScopes) {
+                    buffer.scopes.emplace_back();
+                }
+                buffer.scopes[buffer.numScopes++] = *record.scope;
+            }
+
+            auto time = std::max(record.time, buffer.lastTime + std::chrono::system_clock::duration{1});
+            buffer.lastTime = time;
+
+            auto& text = buffer.pending.text;
+            buffer.entries.push_back({record.severity, buffer.numScopes - 1, text.size(), record.size, record.fields.size, time, record.thread});
+            text.append(record.text, record.size);
+            text.append(record.fields.data, record.fields.size);
+            buffer.pending.add(record.severity, mPolicy);
+        }
+
+        static Record recordOf(const Buffer& buffer, const Entry& entry) {
+            const char* text = buffer.pending.text.data() + entry.text;
+            return {entry.severity, &buffer.scopes[entry.scope], text, entry.size, entry.time, entry.thread, {text + entry.size, entry.fieldsSize}};
+        }
+
+        // Requires the buffer's lock.
+        void writeChunk(Buffer& buffer) {
+            if (buffer.entries.empty()) {
+                buffer.pending.reset();
+                return;
+            }
+
+            size_t count = buffer.entries.size();
+            buffer.records.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                const Entry& entry = buffer.entries[i];
+                buffer.records[i] = recordOf(buffer, entry);
+            }
+
+            // Empty the buffer even if an output throws.
+            struct Reset {
+                Buffer& buffer;
+                ~Reset() {
+                    buffer.entries.clear();
+                    buffer.pending.reset();
+                    buffer.numScopes = 0;
+                }
+            } reset{buffer};
+
+            for (auto& output : mOutputs) {
+                output->timedWriteBatch(buffer.records.data(), count);
+            }
+        }
+
+        void flushBuffers(bool force) {
+            auto now = std::chrono::steady_clock::now();
+            for (auto& buffer : buffers()) {
+                std::lock_guard<std::mutex> lock{buffer->mutex};
+                if (force || now - buffer->pending.lastFlush >= mPolicy.interval) {
+                    try {
+                        writeChunk(*buffer);
+                    } catch (...) {
+                        if (force) {
+                            throw;
+                        }
+                    }
+                }
+            }
+        }
+
+        std::vector<std::shared_ptr<IOutput>> mOutputs;
+        FlushPolicy mPolicy;
+        uint64_t mId;
+
+        mutable std::mutex mMutex;
+        std::vector<std::shared_ptr<Buffer>> mBuffers;
+
+        std::atomic<bool> mFlushedOnCrash{false};
+
+        detail::PeriodicTask mFlushTask;
+    };
+
+#ifndef _WIN32
+    enum class ENetworkProtocol {
+        // RFC 5424 syslog, one message per datagram (RFC 5426).
+        SyslogUdp,
+        // RFC 5424 syslog, framed by octet counting (RFC 6587).
+        SyslogTcp,
+        // The native protocol of systemd-journald, one entry per datagram on a local socket.
+        Journald,
+    };
+
+    // Where NetworkOutput sends its records. `host` is the path of the socket for journald.
+    struct NetworkEndpoint {
+        ENetworkProtocol protocol;
+        std::string host;
+        uint16_t port;
+        // The syslog facility; "user" by default.
+        int facility;
+
+        static NetworkEndpoint syslogUdp(const std::string& host, uint16_t port = 514) {
+            return {ENetworkProtocol::SyslogUdp, host, port, 1};
+        }
+
+        static NetworkEndpoint syslogTcp(const std::string& host, uint16_t port = 514) {
+            return {ENetworkProtocol::SyslogTcp, host, port, 1};
+        }
+
+        static NetworkEndpoint journald(const std::string& path = "/run/systemd/journal/socket") {
+            return {ENetworkProtocol::Journald, path, 0, 1};
+        }
+    };
+
+    // Ships records to a log collector. Logging threads only render records into a bounded buffer; a
+    // background thread owns the non-blocking socket, sends the buffer in batches, and reconnects with
+    // exponential backoff when the collector goes away. Records that do not fit into the buffer while
+    // the collector is slow or unreachable are dropped and counted, so logging never waits for the
+    // network. Syslog datagrams are truncated to 2 KiB and journald entries to 64 KiB. Not available
+    // on Windows.
+    class NetworkOutput : public IOutput {
+    public:
+        NetworkOutput(NetworkEndpoint endpoint, std::string appName = "", size_t bufferSize = 1024 * 1024)
+        : mEndpoint{std::move(endpoint)}, mAppName{std::move(appName)}, mBufferSize{bufferSize} {
+            char hostname[256];
+            if (::gethostname(hostname, sizeof(hostname)) == 0) {
+                hostname[sizeof(hostname) - 1] = '\0';
+                mHostname = hostname;
+            }
+
+            mHeader = " ";
+            mHeader += mHostname.empty() ? "-" : sanitized(mHostname, 255);
+            mHeader += ' ';
+            mHeader += mAppName.empty() ? "-" : sanitized(mAppName, 48);
+            mHeader += ' ';
+            detail::appendUnsigned(mHeader, (unsigned long long)::getpid());
+            mHeader += ' ';
+
+            mWorker = std::thread{[this]() { work(); }};
+        }
+
+        // Tries to send what is still buffered for up to a second.
+        virtual ~NetworkOutput() {
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                mStopDeadline = std::chrono::steady_clock::now() + std::chrono::seconds{1};
+                mStopping.store(true);
+            }
+            mWakeCv.notify_one();
+            mWorker.join();
+        }
+
+        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+            writeRecord(makeRecord(scope, severity, line));
+        }
+
+        void writeRecord(const Record& record) override {
+            NetworkOutput::writeBatch(&record, 1);
+        }
+
+        void writeBatch(const Record* records, size_t count) override {
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                for (size_t i = 0; i < count; ++i) {
+                    append(records[i]);
+                }
+            }
+            mWakeCv.notify_one();
+        }
+
+        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
+            detail::ScratchString text;
+            appendProgressBar(text.get(), current, total, duration, 80);
+            writeLine(scope, ESeverity::Progress, text.get());
+        }
+
+        // Waits up to a second for the buffered records to be sent, unless the collector is unreachable.
+        void flush() override {
+            std::unique_lock<std::mutex> lock{mMutex};
+            mWakeCv.notify_one();
+            mSentCv.wait_for(lock, std::chrono::seconds{1}, [this]() {
+                return (mPending.empty() && mNumSending == 0) || mUnreachable;
+            });
+        }
+
+        std::string name() const override {
+            switch (mEndpoint.protocol) {
+                case ENetworkProtocol::SyslogUdp: return "syslog+udp://" + mEndpoint.host + ":" + std::to_string(mEndpoint.port);
+                case ENetworkProtocol::SyslogTcp: return "syslog+tcp://" + mEndpoint.host + ":" + std::to_string(mEndpoint.port);
+                case ENetworkProtocol::Journald: return "journald:" + mEndpoint.host;
+            }
+            return "";
+        }
+
+        OutputStats stats() const override {
+            OutputStats result = IOutput::stats();
+            std::lock_guard<std::mutex> lock{mMutex};
+            result.queueSize = mNumPending + mNumSending;
+            result.numDropped = mNumDropped;
+            return result;
+        }
+
+        // Number of records discarded because the buffer was full.
+        uint64_t numDropped() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mNumDropped;
+        }
+
+        // Whether the output is waiting to reconnect.
+        bool unreachable() const {
+            std::lock_guard<std::mutex> lock{mMutex};
+            return mUnreachable;
+        }
+
+        const NetworkEndpoint& endpoint() const { return mEndpoint; }
+
+    private:
+        static const size_t MAX_DATAGRAM_SIZE = 2048;
+        static const size_t MAX_JOURNALD_SIZE = 64 * 1024;
+
+#ifdef MSG_NOSIGNAL
+        static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+        static const int SEND_FLAGS = 0;
+#endif
+
+        static int syslogSeverity(ESeverity severity) {
+            switch (severity) {
+                case ESeverity::Error: return 3;
+                case ESeverity::Warning: return 4;
+                case ESeverity::Success: return 5;
+                case ESeverity::Debug: return 7;
+                default: return 6;
+            }
+        }
+
+        // Syslog header fields are printable ASCII without spaces.
+        static std::string sanitized(const std::string& field, size_t maxSize) {
+            std::string result = field.substr(0, maxSize);
+            for (auto& c : result) {
+                if (c <= ' ' || c > '~') {
+                    c = '_';
+                }
+            }
+            return result;
+        }
+
+        // Appends the record to the buffer, preceded by its size, or drops it if it does not fit.
+        void append(const Record& record) {
+            size_t start = mPending.size();
+            mPending.append(4, '\0');
+
+            if (mEndpoint.protocol == ENetworkProtocol::Journald) {
+                appendJournaldEntry(record);
+            } else {
+                appendSyslogMessage(record);
+            }
+
+            size_t size = mPending.size() - start - 4;
+            if (mPending.size() > mBufferSize) {
+                mPending.resize(start);
+                ++mNumDropped;
+                return;
+            }
+
+            uint32_t size32 = (uint32_t)size;
+            std::memcpy(&mPending[start], &size32, 4);
+            ++mNumPending;
+        }
+
+        void appendSyslogMessage(const Record& record) {
+            size_t start = mPending.size();
+
+            // Octet counting: the length of the message is patched in below.
+            if (mEndpoint.protocol == ENetworkProtocol::SyslogTcp) {
+                mPending.append(10, '\0');
+            }
+
+            size_t messageStart = mPending.size();
+            mPending += '<';
+            detail::appendUnsigned(mPending, (unsigned long long)(mEndpoint.facility * 8 + syslogSeverity(record.severity)));
+            mPending += ">1 ";
+            mTimestamp.append(mPending, record.time);
+            mPending += mHeader;
+            if (record.scope->empty()) {
+                mPending += '-';
+            } else {
+                mPending += sanitized(*record.scope, 32);
+            }
+            mPending += " - ";
+            mPending.append(record.text, record.size);
+            detail::appendLogfmtFields(mPending, record.fields);
+
+            if (mEndpoint.protocol == ENetworkProtocol::SyslogTcp) {
+                char prefix[10];
+                char* end = prefix + sizeof(prefix);
+                char* begin = detail::formatDecimal(end - 1, (unsigned long long)(mPending.size() - messageStart));
+                end[-1] = ' ';
+                mPending.erase(start, (size_t)(begin - prefix));
+                std::memcpy(&mPending[start], begin, (size_t)(end - begin));
+            } else if (mPending.size() - messageStart > MAX_DATAGRAM_SIZE) {
+                mPending.resize(messageStart + MAX_DATAGRAM_SIZE);
+            }
+        }
+
+        // Newline-separated fields. Text uses the binary form, which allows newlines.
+        void appendJournaldEntry(const Record& record) {
+            mPending += "PRIORITY=";
+            mPending += (char)('0' + syslogSeverity(record.severity));
+            mPending += "\nSYSLOG_FACILITY=";
+            detail::appendUnsigned(mPending, (unsigned long long)mEndpoint.facility);
+            mPending += '\n';
+
+            if (!mAppName.empty()) {
+                mPending += "SYSLOG_IDENTIFIER=";
+                mPending += sanitized(mAppName, 48);
+                mPending += '\n';
+            }
+
+            if (!record.scope->empty()) {
+                mPending += "TLOG_SCOPE=";
+                mPending += sanitized(*record.scope, 256);
+                mPending += '\n';
+            }
+
+            mPending += "TLOG_THREAD=";
+            detail::appendUnsigned(mPending, record.thread);
+            mPending += '\n';
+
+            // Field names of the journal consist of uppercase letters, digits and underscores, and start
+            // with a letter.
+            record.fields.forEach([this](const Field& field) {
+                if (field.keySize == 0 || !std::isalpha((unsigned char)field.key[0])) {
+                    mPending += "TLOG_";
+                }
+                for (size_t i = 0; i < field.keySize; ++i) {
+                    unsigned char c = (unsigned char)field.key[i];
+                    mPending += std::isalnum(c) ? (char)std::toupper(c) : '_';
+                }
+                appendJournaldValue(field.value, field.valueSize);
+            });
+
+            mPending += "MESSAGE";
+            appendJournaldValue(record.text, record.size < MAX_JOURNALD_SIZE ? record.size : MAX_JOURNALD_SIZE);
+        }
+
+        void appendJournaldValue(const char* value, size_t size) {
+            mPending += '\n';
+            for (int i = 0; i < 8; ++i) {
+                mPending += (char)(((uint64_t)size >> (8 * i)) & 0xff);
+            }
+            mPending.append(value, size);
+            mPending += '\n';
+        }
+
+        void closeSocket() {
+            if (mFd >= 0) {
+                ::close(mFd);
+                mFd = -1;
+            }
+        }
+
+        // Waits until the socket accepts more data. Gives up on errors and once the output is destroyed
+        // and its grace period is over.
+        bool waitWritable() {
+            for (;;) {
+                if (mStopping.load() && std::chrono::steady_clock::now() >= mStopDeadline) {
+                    return false;
+                }
+
+                struct pollfd pfd = {mFd, POLLOUT, 0};
+                int result = ::poll(&pfd, 1, 100);
+                if (result > 0) {
+                    return (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) == 0;
+                } else if (result < 0 && errno != EINTR) {
+                    return false;
+                }
+            }
+        }
+
+        bool connectSocket() {
+            if (mEndpoint.protocol == ENetworkProtocol::Journald) {
+                struct sockaddr_un address;
+                std::memset(&address, 0, sizeof(address));
+                address.sun_family = AF_UNIX;
+                if (mEndpoint.host.size() >= sizeof(address.sun_path)) {
+                    return false;
+                }
+                std::memcpy(address.sun_path, mEndpoint.host.c_str(), mEndpoint.host.size() + 1);
+
+                mFd = ::socket(AF_UNIX, SOCK_DGRAM, 0);
+                if (mFd < 0 || !makeNonBlocking() || ::connect(mFd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+                    closeSocket();
+                    return false;
+                }
+                return true;
+            }
+
+            bool isTcp = mEndpoint.protocol == ENetworkProtocol::SyslogTcp;
+
+            struct addrinfo hints;
+            std::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = isTcp ? SOCK_STREAM : SOCK_DGRAM;
+
+            struct addrinfo* addresses = nullptr;
+            if (::getaddrinfo(mEndpoint.host.c_str(), std::to_string(mEndpoint.port).c_str(), &hints, &addresses) != 0) {
+                return false;
+            }
+
+            for (auto address = addresses; address; address = address->ai_next) {
+                mFd = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+                if (mFd < 0) {
+                    continue;
+                }
+
+                if (makeNonBlocking()) {
+                    int result = ::connect(mFd, address->ai_addr, address->ai_addrlen);
+                    if (result == 0) {
+                        break;
+                    }
+
+                    // Connecting over TCP completes in the background.
+                    if (errno == EINPROGRESS && waitWritable()) {
+                        int error = 0;
+                        socklen_t size = sizeof(error);
+                        if (::getsockopt(mFd, SOL_SOCKET, SO_ERROR, &error, &size) == 0 && error == 0) {
+                            break;
+                        }
+                    }
+                }
+
+                closeSocket();
+            }
+
+            ::freeaddrinfo(addresses);
+            return mFd >= 0;
+        }
+
+        bool makeNonBlocking() {
+            int flags = ::fcntl(mFd, F_GETFL, 0);
+            if (flags < 0 || ::fcntl(mFd, F_SETFL, flags | O_NONBLOCK) != 0) {
+                return false;
+            }
+            ::fcntl(mFd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+            int on = 1;
+            ::setsockopt(mFd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+            return true;
+        }
+
+        // Sends the messages in mSending. Returns false if the connection failed; the message that was
+        // being sent is then resent in full after reconnecting.
+        bool sendBuffered() {
+            bool isStream = mEndpoint.protocol == ENetworkProtocol::SyslogTcp;
+            while (mSendPos < mSending.size()) {
+                uint32_t size;
+                std::memcpy(&size, &mSending[mSendPos], 4);
+                const char* message = &mSending[mSendPos + 4];
+
+                auto start = statsStart();
+                while (mMessagePos < size) {
+                    ssize_t result = ::send(mFd, message + mMessagePos, size - mMessagePos, SEND_FLAGS);
+                    if (result >= 0) {
+                        // Datagrams are sent whole or not at all.
+                        mMessagePos = isStream ? mMessagePos + (size_t)result : size;
+                    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        if (!waitWritable()) {
+                            mMessagePos = 0;
+                            return false;
+                        }
+                    } else if (errno == EMSGSIZE) {
+                        // Could never be sent.
+                        mMessagePos = size;
+                    } else if (errno != EINTR) {
+                        mMessagePos = 0;
+                        return false;
+                    }
+                }
+                countFlush(size, start);
+
+                mSendPos += 4 + size;
+                mMessagePos = 0;
+
+                std::lock_guard<std::mutex> lock{mMutex};
+                --mNumSending;
+            }
+            return true;
+        }
+
+        void work() {
+            const std::chrono::milliseconds minBackoff{100}, maxBackoff{30000};
+            auto backoff = minBackoff;
+
+            std::unique_lock<std::mutex> lock{mMutex};
+            for (;;) {
+                if (mSendPos == mSending.size() && !mPending.empty()) {
+                    // Both buffers keep their capacity, so steady-state logging does not allocate.
+                    std::swap(mPending, mSending);
+                    mPending.clear();
+                    mSendPos = 0;
+                    mNumSending = mNumPending;
+                    mNumPending = 0;
+                }
+
+                if (mSendPos == mSending.size()) {
+                    mSentCv.notify_all();
+                    if (mStopping.load()) {
+                        break;
+                    }
+                    mWakeCv.wait(lock);
+                    continue;
+                }
+
+                if (mStopping.load() && std::chrono::steady_clock::now() >= mStopDeadline) {
+                    break;
+                }
+
+                lock.unlock();
+                bool connected = mFd >= 0 || connectSocket();
+                bool sent = connected && sendBuffered();
+                if (!sent) {
+                    closeSocket();
+                }
+                lock.lock();
+
+                mUnreachable = !sent;
+                if (sent) {
+                    backoff = minBackoff;
+                    continue;
+                }
+
+                mSentCv.notify_all();
+                if (mStopping.load()) {
+                    break;
+                }
+
+                mWakeCv.wait_for(lock, backoff, [this]() { return mStopping.load(); });
+                backoff = std::min(backoff * 2, maxBackoff);
+            }
+
+            lock.unlock();
+            closeSocket();
+        }
+
+        const NetworkEndpoint mEndpoint;
+        const std::string mAppName;
+        const size_t mBufferSize;
+        std::string mHostname;
+        // The syslog header between the timestamp and the MSGID: hostname, app name and process id.
+        std::string mHeader;
+
+        // Guards everything below but the worker's own state.
+        mutable std::mutex mMutex;
+        std::condition_variable mWakeCv;
+        std::condition_variable mSentCv;
+        std::string mPending;
+        size_t mNumPending = 0;
+        size_t mNumSending = 0;
+        uint64_t mNumDropped = 0;
+        bool mUnreachable = false;
+        UtcTimestampCache mTimestamp;
+        std::atomic<bool> mStopping{false};
+        std::chrono::steady_clock::time_point mStopDeadline;
+
+        // Only touched by the worker.
+        int mFd = -1;
+        std::string mSending;
+        size_t mSendPos = 0;
+        size_t mMessagePos = 0;
+
+        std::thread mWorker;
+    };
+#endif
+
+#ifndef _WIN32
+    namespace detail {
+        // The start of the memory of a SharedMemoryRing. Positions count the bytes ever reserved and
+        // consumed, so they never wrap.
+        struct SharedRingHeader {
+            std::atomic<uint64_t> magic;
+            uint64_t capacity;
+            // The process id of the collector, or zero.
+            std::atomic<int32_t> collector;
+
+            // Keep producers and the collector from invalidating each other's cache lines.
+            char pad0[64];
+            std::atomic<uint64_t> head;
+            char pad1[64];
+            std::atomic<uint64_t> tail;
+            char pad2[64];
+
+            std::atomic<uint64_t> numDropped;
+            std::atomic<uint64_t> numFlushRequests;
+            std::atomic<uint64_t> numFlushesDone;
+        };
+
+        // Precedes the scope, text and fields of every record in a SharedMemoryRing.
+        struct SharedRingEntry {
+            uint8_t isProgress;
+            uint8_t severity;
+            uint32_t thread;
+            // Nanoseconds since the epoch of the system clock
+            int64_t time;
+            uint32_t scopeSize;
+            uint32_t textSize;
+            uint32_t fieldsSize;
+            uint64_t current;
+            uint64_t total;
+            int64_t duration;
+        };
+    }
+
+    // Memory shared by processes, into which any number of SharedMemoryOutputs write records for a
+    // single SharedMemoryCollector to hand to the actual outputs. Records are written whole, so lines
+    // of processes logging into the same file no longer interleave, and only the collector has the
+    // file open. Not available on Windows.
+    //
+    // Producers reserve room with a compare-and-swap and never lock, so a process may die at any point
+    // without blocking the others: the collector skips a record whose process died while writing it.
+    // Only a process that dies within the few instructions between reserving room and marking it
+    // stalls the ring.
+    class SharedMemoryRing {
+    public:
+        SharedMemoryRing(const SharedMemoryRing&) = delete;
+        SharedMemoryRing& operator=(const SharedMemoryRing&) = delete;
+
+        ~SharedMemoryRing() {
+            ::munmap(mMemory, mSize);
+        }
+
+        // Memory that processes forked afterwards share, e.g. the workers of a prefork server.
+        static std::shared_ptr<SharedMemoryRing> anonymous(size_t capacity = 4 * 1024 * 1024) {
+            capacity = checkedCapacity(capacity);
+            size_t size = DATA_OFFSET + capacity;
+            void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                throw std::runtime_error{"SharedMemoryRing: could not map " + std::to_string(size) + " bytes"};
+            }
+
+            std::shared_ptr<SharedMemoryRing> ring{new SharedMemoryRing{"", memory, size}};
+            ring->initialize(capacity);
+            return ring;
+        }
+
+        // A ring in a file for unrelated processes to open(), e.g. one in /dev/shm, which never touches
+        // the disk. Replaces any previous file; processes that still have it open keep writing into the
+        // old ring. Called by the collector before the producers open the ring.
+        static std::shared_ptr<SharedMemoryRing> create(const std::string& path, size_t capacity = 4 * 1024 * 1024) {
+            capacity = checkedCapacity(capacity);
+            size_t size = DATA_OFFSET + capacity;
+
+            ::unlink(path.c_str());
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                throw std::runtime_error{"SharedMemoryRing: could not create " + path};
+            }
+
+            if (::ftruncate(fd, (off_t)size) != 0) {
+                ::close(fd);
+                throw std::runtime_error{"SharedMemoryRing: could not resize " + path};
+            }
+
+            std::shared_ptr<SharedMemoryRing> ring{new SharedMemoryRing{path, map(fd, size, path), size}};
+            ring->initialize(capacity);
+            return ring;
+        }
+
+        // Opens a ring made by create().
+        static std::shared_ptr<SharedMemoryRing> open(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+            if (fd < 0) {
+                throw std::runtime_error{"SharedMemoryRing: could not open " + path};
+            }
+
+            struct stat info;
+            if (::fstat(fd, &info) != 0 || (size_t)info.st_size <= DATA_OFFSET) {
+                ::close(fd);
+                throw std::runtime_error{"SharedMemoryRing: " + path + " is not a ring"};
+            }
+
+            size_t size = (size_t)info.st_size;
+            std::shared_ptr<SharedMemoryRing> ring{new SharedMemoryRing{path, map(fd, size, path), size}};
+            if (ring->mHeader->magic.load(std::memory_order_acquire) != MAGIC || DATA_OFFSET + ring->mHeader->capacity != size) {
+                throw std::runtime_error{"SharedMemoryRing: " + path + " is not a ring"};
+            }
+            return ring;
+        }
+
+        // Reserves room for `size` bytes and lets `fill` write them in place. If the ring is full, waits for
+        // the collector to make room if `block` is set, and otherwise returns false. Records larger than
+        // maxRecordSize() are never written. Records that are not written count as dropped.
+        template <typename F>
+        bool tryPush(size_t size, bool block, F&& fill) {
+            uint64_t capacity = mHeader->capacity;
+            if (size > maxRecordSize()) {
+                mHeader->numDropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            uint64_t length = RECORD_HEADER_SIZE + aligned(size);
+            uint64_t head = mHeader->head.load(std::memory_order_relaxed);
+            uint64_t padding;
+            for (int numWaits = 0;;) {
+                // Records do not wrap around; the rest of the ring is skipped instead.
+                uint64_t offset = head % capacity;
+                padding = offset + length > capacity ? capacity - offset : 0;
+
+                // Pairs with the collector releasing the memory, which it zeroes before.
+                if (head + padding + length - mHeader->tail.load(std::memory_order_acquire) > capacity) {
+                    if (!block) {
+                        mHeader->numDropped.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+
+                    if (++numWaits < 100) {
+                        std::this_thread::yield();
+                    } else {
+                        std::this_thread::sleep_for(std::chrono::microseconds{100});
+                    }
+                    head = mHeader->head.load(std::memory_order_relaxed);
+                    continue;
+                }
+
+                if (mHeader->head.compare_exchange_weak(head, head + padding + length, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+
+            int32_t pid = (int32_t)::getpid();
+            if (padding > 0) {
+                mark(head % capacity, pid, PADDING | (uint32_t)padding);
+            }
+
+            uint64_t offset = (head + padding) % capacity;
+            mark(offset, pid, RESERVED | (uint32_t)size);
+            try {
+                fill(mData + offset + RECORD_HEADER_SIZE);
+            } catch (...) {
+                mark(offset, pid, PADDING | (uint32_t)length);
+                throw;
+            }
+            mark(offset, pid, COMMITTED | (uint32_t)size);
+            return true;
+        }
+
+        // Lets `consume` read the oldest record and returns true, or returns false if there is none or it is
+        // still being written. Only the collector may call this.
+        template <typename F>
+        bool tryPop(F&& consume) {
+            uint64_t capacity = mHeader->capacity;
+            for (;;) {
+                uint64_t tail = mHeader->tail.load(std::memory_order_relaxed);
+                if (tail == mHeader->head.load(std::memory_order_acquire)) {
+                    return false;
+                }
+
+                uint64_t offset = tail % capacity;
+                uint32_t state = stateAt(offset).load(std::memory_order_acquire);
+                uint32_t size = state & SIZE_MASK;
+                switch (state & ~SIZE_MASK) {
+                    case PADDING:
+                        release(tail, size);
+                        break;
+                    case RESERVED:
+                        if (isAlive(pidAt(offset))) {
+                            return false;
+                        }
+                        mHeader->numDropped.fetch_add(1, std::memory_order_relaxed);
+                        release(tail, RECORD_HEADER_SIZE + aligned(size));
+                        break;
+                    case COMMITTED:
+                        try {
+                            consume((const char*)(mData + offset + RECORD_HEADER_SIZE), (size_t)size);
+                        } catch (...) {
+                            release(tail, RECORD_HEADER_SIZE + aligned(size));
+                            throw;
+                        }
+                        release(tail, RECORD_HEADER_SIZE + aligned(size));
+                        return true;
+                    default:
+                        // Reserved, but not marked yet.
+                        return false;
+                }
+            }
+        }
+
+        // Makes this process the collector of the ring. Fails if another live process is.
+        bool claimCollector() {
+            int32_t pid = (int32_t)::getpid();
+            int32_t collector = 0;
+            while (!mHeader->collector.compare_exchange_strong(collector, pid)) {
+                if (collector == pid || isAlive(collector)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void releaseCollector() {
+            int32_t pid = (int32_t)::getpid();
+            mHeader->collector.compare_exchange_strong(pid, 0);
+        }
+
+        // Producers wait for a flush with isFlushed(requestFlush(), numBytesReserved()), the latter taken before.
+        uint64_t requestFlush() { return mHeader->numFlushRequests.fetch_add(1) + 1; }
+        bool isFlushed(uint64_t request, uint64_t position) const {
+            return numBytesConsumed() >= position && mHeader->numFlushesDone.load() >= request;
+        }
+
+        // The collector flushes its outputs once it has consumed everything, then reports the requests it saw before.
+        uint64_t numFlushRequests() const { return mHeader->numFlushRequests.load(); }
+        void completeFlushes(uint64_t request) { mHeader->numFlushesDone.store(request); }
+
+        uint64_t numBytesReserved() const { return mHeader->head.load(std::memory_order_acquire); }
+        uint64_t numBytesConsumed() const { return mHeader->tail.load(std::memory_order_acquire); }
+        bool empty() const { return numBytesConsumed() == numBytesReserved(); }
+
+        size_t capacity() const { return (size_t)mHeader->capacity; }
+        size_t maxRecordSize() const { return capacity() / 4 - RECORD_HEADER_SIZE; }
+
+        // Records of all processes that were discarded because the ring was full, or skipped because their
+        // process died while writing them.
+        uint64_t numDropped() const { return mHeader->numDropped.load(std::memory_order_relaxed); }
+
+        // The file of the ring, or empty for anonymous() ones.
+        const std::string& path() const { return mPath; }
+
+    private:
+        static const uint64_t MAGIC = 0x31474e49524d4853ull;
+        static const size_t DATA_OFFSET = 512;
+        static const size_t RECORD_HEADER_SIZE = 8;
+
+        // Records start with a state word, which holds the kind and the size, and the id of the process
+        // that wrote them. Padding spans to the end of the ring, or over a record that could not be filled.
+        static const uint32_t SIZE_MASK = (1u << 30) - 1;
+        static const uint32_t PADDING = 1u << 30;
+        static const uint32_t RESERVED = 2u << 30;
+        static const uint32_t COMMITTED = 3u << 30;
+
+        SharedMemoryRing(std::string path, void* memory, size_t size)
+        : mPath{std::move(path)}, mMemory{memory}, mSize{size}, mHeader{(detail::SharedRingHeader*)memory}, mData{(char*)memory + DATA_OFFSET} {
+            static_assert(sizeof(detail::SharedRingHeader) <= DATA_OFFSET, "The header of a SharedMemoryRing must precede its data.");
+            static_assert(sizeof(std::atomic<uint32_t>) == 4, "The state of a record must be a plain 32-bit word.");
+        }
+
+        static size_t checkedCapacity(size_t capacity) {
+            if (capacity < 4096 || capacity > SIZE_MASK) {
+                throw std::invalid_argument{"SharedMemoryRing: capacity must be between 4 KiB and 1 GiB."};
+            }
+            return (size_t)aligned(capacity);
+        }
+
+        // Closes the file, which the mapping keeps alive.
+        static void* map(int fd, size_t size, const std::string& path) {
+            void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (memory == MAP_FAILED) {
+                throw std::runtime_error{"SharedMemoryRing: could not map " + path};
+            }
+            return memory;
+        }
+
+        static uint64_t aligned(uint64_t size) { return (size + 7) & ~(uint64_t)7; }
+
+        static bool isAlive(int32_t pid) {
+            return pid > 0 && (::kill(pid, 0) == 0 || errno == EPERM);
+        }
+
+        // The memory is zero, as mapped. The magic goes last, such that open() does not see a partial header.
+        void initialize(size_t capacity) {
+            if (!mHeader->head.is_lock_free()) {
+                throw std::runtime_error{"SharedMemoryRing: 64-bit atomics are not lock-free on this platform."};
+            }
+            mHeader->capacity = capacity;
+            mHeader->magic.store(MAGIC, std::memory_order_release);
+        }
+
+        std::atomic<uint32_t>& stateAt(uint64_t offset) { return *(std::atomic<uint32_t>*)(mData + offset); }
+        int32_t& pidAt(uint64_t offset) { return *(int32_t*)(mData + offset + 4); }
+
+        void mark(uint64_t offset, int32_t pid, uint32_t state) {
+            pidAt(offset) = pid;
+            stateAt(offset).store(state, std::memory_order_release);
+        }
+
+        // Producers expect consumed memory to be zero.
+        void release(uint64_t tail, uint64_t length) {
+            std::memset(mData + tail % mHeader->capacity, 0, (size_t)length);
+            mHeader->tail.store(tail + length, std::memory_order_release);
+        }
+
+        const std::string mPath;
+        void* mMemory;
+        size_t mSize;
+        detail::SharedRingHeader* mHeader;
+        char* mData;
+    };
+
+    // Writes records into a SharedMemoryRing, from which a SharedMemoryCollector, usually in another
+    // process, hands them to the actual outputs. It has neither a thread nor a buffer of its own, so it
+    // may be created before forking and used by all children, and records survive the crash of the
+    // process that wrote them. Text that does not fit into SharedMemoryRing::maxRecordSize() is cut.
+    class SharedMemoryOutput : public IOutput {
+    public:
+        // Records are only ever dropped if the ring is full and the policy is DropNewest; with Block, writers
+        // wait for a collector to make room. The collector consumes the ring alone, so DropOldest is not
+        // supported.
+        SharedMemoryOutput(std::shared_ptr<SharedMemoryRing> ring, EOverflowPolicy overflowPolicy = EOverflowPolicy::Block)
+        : mRing{std::move(ring)}, mOverflowPolicy{overflowPolicy} {
+            if (overflowPolicy == EOverflowPolicy::DropOldest) {
+                throw std::invalid_argument{"SharedMemoryOutput: DropOldest is not supported."};
+            }
+        }
+
+        void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+            writeRecord(makeRecord(scope, severity, line));
+        }
+
+        void writeRecord(const Record& record) override {
+            auto start = statsStart();
+            detail::SharedRingEntry entry = {};
+            entry.severity = (uint8_t)record.severity;
+            entry.thread = record.thread;
+            entry.time = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(record.time.time_since_epoch()).count();
+            entry.scopeSize = (uint32_t)record.scope->size();
+            entry.fieldsSize = (uint32_t)record.fields.size;
+
+            // Only the text is truncated. Records whose scope and fields alone are too large are left to
+            // tryPush(), which counts them as dropped.
+            size_t size = sizeof(entry) + entry.scopeSize + entry.fieldsSize;
+            size_t textSize = size < mRing->maxRecordSize() ? std::min(record.size, mRing->maxRecordSize() - size) : 0;
+            entry.textSize = (uint32_t)textSize;
+            size += textSize;
+
+            bool written = mRing->tryPush(size, mOverflowPolicy == EOverflowPolicy::Block, [&](char* out) {
+                std::memcpy(out, &entry, sizeof(entry));
+                out += sizeof(entry);
+                std::memcpy(out, record.scope->data(), entry.scopeSize);
+                out += entry.scopeSize;
+                std::memcpy(out, record.text, textSize);
+                out += textSize;
+                std::memcpy(out, record.fields.data, entry.fieldsSize);
+            });
+
+            if (written) {
+                countFlush(size, start);
+            }
+        }
+
+        void writeProgress(const std::string& scope, uint64_t current, uint64_t total, duration_t duration) override {
+            // Report invalid progress to the caller rather than failing in the collector.
+            checkProgress(current, total);
+
+            detail::SharedRingEntry entry = {};
+            entry.isProgress = 1;
+            entry.severity = (uint8_t)ESeverity::Progress;
+            entry.thread = detail::threadIndex();
+            entry.scopeSize = (uint32_t)scope.size();
+            entry.current = current;
+            entry.total = total;
+            entry.duration = (int64_t)duration.count();
+
+            mRing->tryPush(sizeof(entry) + scope.size(), mOverflowPolicy == EOverflowPolicy::Block, [&](char* out) {
+                std::memcpy(out, &entry, sizeof(entry));
+                std::memcpy(out + sizeof(entry), scope.data(), scope.size());
+            });
+        }
+
+        // Waits up to a second for the collector to hand the records written so far to its outputs and to
+        // flush them.
+        void flush() override {
+            uint64_t position = mRing->numBytesReserved();
+            uint64_t request = mRing->requestFlush();
+
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{1};
+            while (!mRing->isFlushed(request, position) && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds{1});
+            }
+        }
+
+        std::string name() const override {
+            return mRing->path().empty() ? "shm" : "shm:" + mRing->path();
+        }
+
+        // Drops are counted across all processes writing into the ring.
+        OutputStats stats() const override {
+            OutputStats result = IOutput::stats();
+            result.numDropped = numDropped();
+            return result;
+        }
+
+        uint64_t numDropped() const { return mRing->numDropped(); }
+
+        EOverflowPolicy overflowPolicy() const { return mOverflowPolicy; }
+
+        const std::shared_ptr<SharedMemoryRing>& ring() const { return mRing; }
+
+    private:
+        std::shared_ptr<SharedMemoryRing> mRing;
+        EOverflowPolicy mOverflowPolicy;
+    };
+
+    // Hands the records of a SharedMemoryRing to outputs on a background thread, e.g. created in the
+    // parent of a prefork server or in a dedicated collector process. Each ring has one collector at a
+    // time. Thread indices of records are those of the processes that wrote them.
+    class SharedMemoryCollector {
+    public:
+        // Records are handed to the outputs in the given order. Duplicates are ignored.
+        SharedMemoryCollector(std::shared_ptr<SharedMemoryRing> ring, const std::vector<std::shared_ptr<IOutput>>& outputs = {ConsoleOutput::global()})
+        : mRing{std::move(ring)}, mOutputs{detail::uniqueOutputs(outputs)}, mPid{::getpid()} {
+            if (!mRing->claimCollector()) {
+                throw std::runtime_error{"SharedMemoryCollector: the ring already has a collector."};
+            }
+            mWorker.reset(new std::thread{[this]() { work(); }});
+        }
+
+        // Outputs given as a set are ordered by their address. A template, such that braced lists pick the vector.
+        template <typename Compare, typename Allocator>
+        SharedMemoryCollector(std::shared_ptr<SharedMemoryRing> ring, const std::set<std::shared_ptr<IOutput>, Compare, Allocator>& outputs)
+        : SharedMemoryCollector(std::move(ring), std::vector<std::shared_ptr<IOutput>>(outputs.begin(), outputs.end())) {}
+
+        SharedMemoryCollector(const SharedMemoryCollector&) = delete;
+        SharedMemoryCollector& operator=(const SharedMemoryCollector&) = delete;
+
+        // Hands the remaining complete records to the outputs and flushes them. Children forked from the
+        // collector's process inherit the object but not its thread, so it merely lets go of it there.
+        ~SharedMemoryCollector() {
+            if (::getpid() != mPid) {
+                mWorker.release();
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                mStopping = true;
+            }
+            mWakeCv.notify_one();
+            mWorker->join();
+            mRing->releaseCollector();
+        }
+
+        const std::shared_ptr<SharedMemoryRing>& ring() const { return mRing; }
+        const std::vector<std::shared_ptr<IOutput>>& outputs() const { return mOutputs; }
+
+    private:
+        static const size_t MAX_BATCH_SIZE = 1024;
+
+        // There is nobody to report errors to on the worker thread. Skip records rather than terminating.
+        void write(const char* data, size_t size) {
+            detail::SharedRingEntry entry;
+            if (size < sizeof(entry)) {
+                return;
+            }
+
+            std::memcpy(&entry, data, sizeof(entry));
+            if ((uint64_t)sizeof(entry) + entry.scopeSize + entry.textSize + entry.fieldsSize > size) {
+                return;
+            }
+
+            const char* scope = data + sizeof(entry);
+            const char* text = scope + entry.scopeSize;
+            const char* fields = text + entry.textSize;
+            mScope.assign(scope, entry.scopeSize);
+
+            if (entry.isProgress) {
+                for (auto& output : mOutputs) {
+                    try {
+                        output->writeProgress(mScope, entry.current, entry.total, duration_t{entry.duration});
+                    } catch (...) {}
+                }
+                return;
+            }
+
+            auto time = std::chrono::system_clock::time_point{std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds{entry.time})};
+            Record record = {(ESeverity)entry.severity, &mScope, text, entry.textSize, time, entry.thread, {fields, entry.fieldsSize}};
+            for (auto& output : mOutputs) {
+                try {
+                    output->timedWriteRecord(record);
+                } catch (...) {}
+            }
+        }
+
+        size_t collect() {
+            size_t numCollected = 0;
+            while (numCollected < MAX_BATCH_SIZE && mRing->tryPop([this](const char* data, size_t size) { write(data, size); })) {
+                ++numCollected;
+            }
+            return numCollected;
+        }
+
+        void flushOutputs() {
+            for (auto& output : mOutputs) {
+                try {
+                    output->flush();
+                } catch (...) {}
+            }
+        }
+
+        // Producers cannot wake us across processes, so we poll.
+        void work() {
+            uint64_t numFlushed = 0;
+            std::unique_lock<std::mutex> lock{mMutex};
+            for (;;) {
+                lock.unlock();
+                uint64_t request = mRing->numFlushRequests();
+                size_t numCollected = collect();
+                if (request != numFlushed && mRing->empty()) {
+                    flushOutputs();
+                    mRing->completeFlushes(request);
+                    numFlushed = request;
+                }
+                lock.lock();
+
+                if (numCollected > 0) {
+                    continue;
+                }
+
+                if (mStopping) {
+                    break;
+                }
+
+                mWakeCv.wait_for(lock, std::chrono::milliseconds{1});
+            }
+
+            lock.unlock();
+            flushOutputs();
+        }
+
+        std::shared_ptr<SharedMemoryRing> mRing;
+        std::vector<std::shared_ptr<IOutput>> mOutputs;
+        const pid_t mPid;
+
+        std::mutex mMutex;
+        std::condition_variable mWakeCv;
+        bool mStopping = false;
+
+        // Only touched by the worker.
+        std::string mScope;
+
+        std::unique_ptr<std::thread> mWorker;
+    };
+#endif
+
+
+      /////////////////////////////////////////
+     /// Logger stuff for managing outputs ///
+    /////////////////////////////////////////
+    class Logger;
+
+    namespace detail {
+        // Makes an std::ostream append to an std::string.
+        class StringAppender : public std::streambuf {
+        public:
+            StringAppender(std::string& target) : mTarget(target) {}
+
+        protected:
+            int_type overflow(int_type c) override {
+                if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                    mTarget.push_back(traits_type::to_char_type(c));
+                }
+                return traits_type::not_eof(c);
+            }
+
+            std::streamsize xsputn(const char* str, std::streamsize size) override {
+                mTarget.append(str, (size_t)size);
+                return size;
+            }
+
+        private:
+            std::string& mTarget;
+        };
+
+        // Text of a Stream. Both the text and the optional std::ostream survive across streams.
+        struct StreamBuffer {
+            std::string text;
+            // Encoded as read by Fields::forEach().
+            std::string fields;
+
+            // Only created for types without a fast path, e.g. user types with their own operator<<.
+            std::unique_ptr<StringAppender> appender;
+            std::unique_ptr<std::ostream> ostream;
+
+            // Once the std::ostream was used (e.g. for a manipulator such as std::hex), all remaining
+            // elements go through it as well such that its formatting state is respected.
+            bool usesOstream = false;
+
+            StreamBuffer* next = nullptr;
+
+            std::ostream& stream() {
+                if (!ostream) {
+                    appender.reset(new StringAppender{text});
+                    ostream.reset(new std::ostream{appender.get()});
+                }
+                usesOstream = true;
+                return *ostream;
+            }
+
+            void reset() {
+                text.clear();
+                fields.clear();
+                if (usesOstream) {
+                    ostream->clear();
+                    ostream->flags(std::ios_base::skipws | std::ios_base::dec);
+                    ostream->precision(6);
+                    ostream->width(0);
+                    ostream->fill(' ');
+                    usesOstream = false;
+                }
+            }
+        };
+
+        // Per-thread free list of stream buffers. They keep their capacity when recycled, so that
+        // steady-state logging does not allocate.
+        class StreamBufferPool {
+        public:
+            static StreamBuffer* acquire() {
+                auto& state = threadState();
+                if (state.head) {
+                    auto buffer = state.head;
+                    state.head = buffer->next;
+                    return buffer;
+                }
+
+                static thread_local Cleanup cleanup;
+                return new StreamBuffer{};
+            }
+
+            static void release(StreamBuffer* buffer) {
+                // Don't hang on to buffers of exceptionally long lines.
+                static const size_t MAX_CAPACITY = 64 * 1024;
+
+                auto& state = threadState();
+                if (state.destroyed || buffer->text.capacity() > MAX_CAPACITY) {
+                    delete buffer;
+                    return;
+                }
+
+                buffer->reset();
+                buffer->next = state.head;
+                state.head = buffer;
+            }
+
+        private:
+            // Trivially destructible, such that it remains usable while the thread is torn down.
+            struct State {
+                StreamBuffer* head;
+                bool destroyed;
+            };
+
+            struct Cleanup {
+                ~Cleanup() {
+                    auto& state = threadState();
+                    while (state.head) {
+                        auto buffer = state.head;
+                        state.head = buffer->next;
+                        delete buffer;
+                    }
+                    state.destroyed = true;
+                }
+            };
+
+            static State& threadState() {
+                static thread_local State state = {nullptr, false};
+                return state;
+            }
+        };
+
+        struct StreamBufferReleaser {
+            void operator()(StreamBuffer* buffer) const {
+                StreamBufferPool::release(buffer);
+            }
+        };
+    }
+
+    template <typename L>
+    class BasicStream {
+    public:
+        // Streams of hidden severities neither allocate nor format anything.
+        BasicStream(L* logger, ESeverity severity)
+        : mLogger{logger}, mSeverity{severity}, mBuffer{logger->isEnabled(severity) ? detail::StreamBufferPool::acquire() : nullptr} {}
+
+        BasicStream(BasicStream&& other) = default;
+
+        ~BasicStream() {
+            if (mBuffer) {
+                mLogger->log(mSeverity, mBuffer->text.data(), mBuffer->text.size(), {mBuffer->fields.data(), mBuffer->fields.size()});
+            }
+        }
+
+        BasicStream& operator=(BasicStream&& other) = default;
+
+        // Fast paths for common types which bypass std::ostream. Their output is identical
+        // to that of an std::ostream with default formatting state.
+        BasicStream& operator<<(const std::string& str) { return writeFast(str, str.data(), str.size()); }
+        BasicStream& operator<<(const char* str) { return str ? writeFast(str, str, std::strlen(str)) : *this; }
+        BasicStream& operator<<(char c) { return writeFast(c, &c, 1); }
+        BasicStream& operator<<(bool value) { return writeFast(value, value ? "1" : "0", 1); }
+
+        BasicStream& operator<<(int value)                { return writeSigned(value);   }
+        BasicStream& operator<<(long value)               { return writeSigned(value);   }
+        BasicStream& operator<<(long long value)          { return writeSigned(value);   }
+        BasicStream& operator<<(unsigned int value)       { return writeUnsigned(value); }
+        BasicStream& operator<<(unsigned long value)      { return writeUnsigned(value); }
+        BasicStream& operator<<(unsigned long long value) { return writeUnsigned(value); }
+
+        BasicStream& operator<<(float value)       { return writeFloat(value, "%g", (double)value); }
+        BasicStream& operator<<(double value)      { return writeFloat(value, "%g", value);         }
+        BasicStream& operator<<(long double value) { return writeFloat(value, "%Lg", value);        }
+
+        template <typename T>
+        BasicStream& operator<<(const T& elem) {
+            if (mBuffer) {
+                mBuffer->stream() << elem;
+            }
+            return *this;
+        }
+
+        // Only evaluated if the stream is enabled, see tlog::lazy().
+        template <typename F>
+        BasicStream& operator<<(const Lazy<F>& value) {
+            if (mBuffer) {
+                *this << value();
+            }
+            return *this;
+        }
+
+        // Attaches a key-value field to the record, e.g. `logger.info().kv("req", id).kv("ms", ms) << "done";`.
+        // Numbers and booleans keep their type in structured outputs such as JsonOutput; all other values
+        // are rendered like the arguments of logFormat(). Text outputs show fields as `key=value` after the text.
+        template <typename T>
+        BasicStream& kv(const char* key, const T& value) {
+            if (mBuffer) {
+                detail::appendField(mBuffer->fields, key, value);
+            }
+            return *this;
+        }
+
+        bool isEnabled() const { return mBuffer != nullptr; }
+
+    private:
+        template <typename T>
+        BasicStream& writeFast(const T& value, const char* str, size_t size) {
+            if (mBuffer) {
+                if (mBuffer->usesOstream) {
+                    *mBuffer->ostream << value;
+                } else {
+                    mBuffer->text.append(str, size);
+                }
+            }
+            return *this;
+        }
+
+        template <typename T>
+        BasicStream& writeSigned(T value) {
+            char digits[24];
+            char* end = digits + sizeof(digits);
+            char* begin;
+            if (value < 0) {
+                begin = detail::formatDecimal(end, 0ull - (unsigned long long)value);
+                *--begin = '-';
+            } else {
+                begin = detail::formatDecimal(end, (unsigned long long)value);
+            }
+            return writeFast(value, begin, (size_t)(end - begin));
+        }
+
+        template <typename T>
+        BasicStream& writeUnsigned(T value) {
+            char digits[24];
+            char* end = digits + sizeof(digits);
+            char* begin = detail::formatDecimal(end, (unsigned long long)value);
+            return writeFast(value, begin, (size_t)(end - begin));
+        }
+
+        template <typename T, typename U>
+        BasicStream& writeFloat(T value, const char* format, U printfValue) {
+            if (mBuffer && !mBuffer->usesOstream) {
+                char str[64];
+                int size = std::snprintf(str, sizeof(str), format, printfValue);
+                if (size > 0 && size < (int)sizeof(str)) {
+                    mBuffer->text.append(str, (size_t)size);
+                    return *this;
+                }
+            }
+            return writeFast(value, "", 0);
+        }
+
+        L* mLogger;
+        ESeverity mSeverity;
+        std::unique_ptr<detail::StreamBuffer, detail::StreamBufferReleaser> mBuffer;
+    };
+
+    // The stream of a Logger. See StaticLogger for the other kind of logger.
+    using Stream = BasicStream<Logger>;
+
+    // Limits how often Progress::update() renders the progress bar. An update is only rendered once
+    // `minInterval` has passed and `minDelta` (a fraction of the total) was made since the last one.
+    // Reaching the total is always rendered.
+    struct ProgressThrottle {
+        std::chrono::milliseconds minInterval;
+        double minDelta;
+
+        static ProgressThrottle none() {
+            return {std::chrono::milliseconds{0}, 0.0};
+        }
+
+        // At most 20 renderings per second and 1000 overall.
+        static ProgressThrottle every(
+            std::chrono::milliseconds minInterval = std::chrono::milliseconds{50},
+            double minDelta = 0.001
+        ) {
+            return {minInterval, minDelta};
+        }
+    };
+
+    namespace detail {
+        // std::index_sequence is C++14.
+        template <size_t... I>
+        struct IndexSequence {};
+
+        template <size_t N, size_t... I>
+        struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {};
+
+        template <size_t... I>
+        struct MakeIndexSequence<0, I...> {
+            using type = IndexSequence<I...>;
+        };
+
+    }
+
+    // Dropped updates cost a relaxed store and a comparison, and may come from multiple threads.
+    //
+    // Parallel loops should report their progress with advance() instead of update(). It adds to one
+    // of several counters, each on its own cache line, so that many threads do not contend on a single
+    // one. Whichever thread happens to find the throttle expired sums the counters and renders. Call
+    // finish() after the loop to render the final state. Do not mix update() and advance().
+    class Progress {
+    public:
+        Progress(Logger* logger, uint64_t total, ProgressThrottle throttle = ProgressThrottle::every())
+        : mLogger{logger}, mStartTime{std::chrono::steady_clock::now()}, mTotal{total}, mState{new State} {
+            mMinInterval = std::chrono::duration_cast<std::chrono::nanoseconds>(throttle.minInterval).count();
+            mMinDelta = (uint64_t)(throttle.minDelta * (double)total);
+            update(0); // Initial print with 0 progress.
+        }
+
+        void update(uint64_t current);
+        void advance(uint64_t amount = 1);
+        void finish();
+
+        duration_t duration() const {
+            return std::chrono::duration_cast<duration_t>(std::chrono::steady_clock::now() - mStartTime);
+        }
+
+        uint64_t current() const {
+            uint64_t current = mState->current.load(std::memory_order_relaxed);
+            for (auto& shard : mState->shards) {
+                current += shard.count.load(std::memory_order_relaxed);
+            }
+            return current;
+        }
+
+        uint64_t total() const {
+            return mTotal;
+        }
+
+    private:
+        static const size_t NUM_SHARDS = 64;
+
+        struct Shard {
+            std::atomic<uint64_t> count{0};
+            char padding[64 - sizeof(std::atomic<uint64_t>)];
+        };
+
+        // Renders if the throttle's interval expired, unless another thread beats us to it.
+        void render(uint64_t current, bool force);
+
+        // Whether the throttle's interval expired and no other thread claimed the rendering before us.
+        bool claimRendering(std::chrono::steady_clock::duration& elapsed, bool& isTooEarly);
+
+        struct State {
+            std::atomic<uint64_t> current{0};
+            // Keeps the stores to `current` from evicting the fields that every update reads.
+            char padding1[64];
+            // Earliest value and time (in nanoseconds since mStartTime) of the next rendering.
+            std::atomic<uint64_t> nextValue{0};
+            std::atomic<int64_t> nextTime{0};
+
+            char padding2[64];
+            Shard shards[NUM_SHARDS];
+        };
+
+        Logger* mLogger;
+        std::chrono::steady_clock::time_point mStartTime;
+        uint64_t mTotal;
+        int64_t mMinInterval;
+        uint64_t mMinDelta;
+
+        // Behind a pointer such that Progress stays movable.
+        std::unique_ptr<State> mState;
+    };
+
+    namespace detail {
+        // Holds an immutable value which readers access without taking a lock. Writers publish a
+        // modified copy and free the old one only once no reader can still be looking at it.
+        // Readers register in one of two counters, selected by the current epoch. Writers flip the
+        // epoch, so that the counters they wait on are guaranteed to drain even under constant load.
+        // The counters are sharded by thread, so that readers on different cores don't contend.
+        template <typename T>
+        class Published {
+        public:
+            Published(T value) : mValue{new T(std::move(value))} {
+                for (auto& shard : mShards) {
+                    shard.numReaders[0].store(0);
+                    shard.numReaders[1].store(0);
+                }
+            }
+
+            ~Published() {
+                delete mValue.load();
+            }
+
+            template <typename F>
+            void read(F&& f) const {
+                // A writer that bumped the epoch after we picked our counter may not wait for it. Retry
+                // until the counter is the one of the current epoch, which the next writer waits for.
+                auto& shard = mShards[threadIndex() % NUM_SHARDS];
+                std::atomic<int>* numReaders;
+                for (;;) {
+                    unsigned epoch = mEpoch.load();
+                    numReaders = &shard.numReaders[epoch & 1];
+                    numReaders->fetch_add(1);
+                    if (mEpoch.load() == epoch) {
+                        break;
+                    }
+                    numReaders->fetch_sub(1, std::memory_order_release);
+                }
+
+                struct Guard {
+                    std::atomic<int>& numReaders;
+                    ~Guard() { numReaders.fetch_sub(1, std::memory_order_release); }
+                } guard{*numReaders};
+
+                f(*mValue.load());
+            }
+
+            T get() const {
+                T result;
+                read([&](const T& value) { result = value; });
+                return result;
+            }
+
+            template <typename F>
+            void update(F&& modify) {
+                std::lock_guard<std::mutex> lock{mWriteMutex};
+
+                std::unique_ptr<T> value{new T(*mValue.load())};
+                modify(*value);
+                std::unique_ptr<T> old{mValue.exchange(value.release())};
+
+                unsigned epoch = mEpoch.fetch_add(1) & 1;
+                for (auto& shard : mShards) {
+                    while (shard.numReaders[epoch].load() != 0) {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+
+        private:
+            static const size_t NUM_SHARDS = 16;
+
+            // Leading padding, such that the first shard does not share a cache line with mValue and mEpoch,
+            // which every read loads.
+            struct Shard {
+                char padding[64 - 2 * sizeof(std::atomic<int>)];
+                std::atomic<int> numReaders[2];
+            };
+
+            std::atomic<T*> mValue;
+            std::atomic<unsigned> mEpoch{0};
+            std::mutex mWriteMutex;
+            mutable Shard mShards[NUM_SHARDS];
+        };
+
+        class ScopeRegistry;
+    }
+
+    // An interned scope name. Loggers with equal scopes share one instance, so creating a logger for a
+    // scope that is already in use neither copies nor allocates its name. Scopes are hierarchical, with
+    // components separated by dots, e.g. "db.pool.conn"; see setScopeSeverities().
+    class Scope {
+    public:
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        const std::string& name() const { return mName; }
+
+        // Distinct for every scope created during the lifetime of the process.
+        uint64_t id() const { return mId; }
+
+    private:
+        friend class detail::ScopeRegistry;
+        Scope(std::string name, uint64_t id) : mName{std::move(name)}, mId{id} {}
+
+        const std::string mName;
+        const uint64_t mId;
+    };
+
+    namespace detail {
+        class ScopeRegistry {
+        public:
+            // Never destroyed, such that loggers with static storage duration may still be created and
+            // destroyed while the program exits.
+            static ScopeRegistry& global() {
+                static auto registry = new ScopeRegistry{};
+                return *registry;
+            }
+
+            // Scopes stay registered while a logger refers to them.
+            std::shared_ptr<const Scope> intern(const std::string& name) {
+                std::lock_guard<std::mutex> lock{mMutex};
+                auto& entry = mScopes[name];
+                auto scope = entry.lock();
+                if (!scope) {
+                    scope = std::shared_ptr<const Scope>{new Scope{name, mNextId++}};
+                    entry = scope;
+
+                    // Per-request scopes must not grow the registry indefinitely.
+                    if (mScopes.size() >= 2 * mNumAfterPrune + 64) {
+                        for (auto it = mScopes.begin(); it != mScopes.end();) {
+                            it = it->second.expired() ? mScopes.erase(it) : std::next(it);
+                        }
+                        mNumAfterPrune = mScopes.size();
+                    }
+                }
+                return scope;
+            }
+
+            void setSeverities(const std::string& scope, uint32_t mask) {
+                std::lock_guard<std::mutex> lock{mMutex};
+                mRules[scope] = mask;
+            }
+
+            void resetSeverities() {
+                std::lock_guard<std::mutex> lock{mMutex};
+                mRules.clear();
+            }
+
+            // The severities of the most specific rule that covers `scope`.
+            uint32_t severities(const std::string& scope) const {
+                std::lock_guard<std::mutex> lock{mMutex};
+                if (!mRules.empty()) {
+                    std::string prefix = scope;
+                    for (;;) {
+                        auto it = mRules.find(prefix);
+                        if (it != mRules.end()) {
+                            return it->second;
+                        }
+
+                        if (prefix.empty()) {
+                            break;
+                        }
+
+                        size_t dot = prefix.rfind('.');
+                        prefix.resize(dot == std::string::npos ? 0 : dot);
+                    }
+                }
+
+#ifdef NDEBUG
+                return ALL_SEVERITIES & ~severityMask(ESeverity::Debug);
+#else
+                return ALL_SEVERITIES;
+#endif
+            }
+
+        private:
+            ScopeRegistry() = default;
+
+            mutable std::mutex mMutex;
+            std::map<std::string, std::weak_ptr<const Scope>> mScopes;
+            size_t mNumAfterPrune = 0;
+            uint64_t mNextId = 0;
+            std::map<std::string, uint32_t> mRules;
+        };
+    }
+
+    // Loggers created from now on for `scope` or any scope below it, such as "db.pool" for "db", only
+    // show `severities`, a bitmask of severityMask() values. The most specific rule wins; the empty scope
+    // covers all of them. Existing loggers keep their severities. Without any rule, all severities
+    // but Debug in builds with NDEBUG are shown.
+    inline void setScopeSeverities(const std::string& scope, uint32_t severities) {
+        detail::ScopeRegistry::global().setSeverities(scope, severities);
+    }
+
+    inline void resetScopeSeverities() {
+        detail::ScopeRegistry::global().resetSeverities();
+    }
+
+    // All member functions may be called concurrently from any number of threads. Changes to the
+    // outputs or the scope are published as a new snapshot, so that logging never takes a lock
+    // inside the logger; each output serializes its own writes. Replacing the global() logger
+    // itself is not thread-safe.
+    class Logger {
+    public:
+        // Records are handed to the outputs in the given order. Duplicates are ignored. The severities
+        // follow setScopeSeverities().
+        Logger(const std::string& scope = "", const std::vector<std::shared_ptr<IOutput>>& outputs = {ConsoleOutput::global()})
+        : Logger{detail::ScopeRegistry::global().intern(scope), makeOutputs(outputs)} {}
+
+        Logger(const std::vector<std::shared_ptr<IOutput>>& outputs) : Logger("", outputs) {}
+
+        // Outputs given as a set are ordered by their address. Templates, such that braced lists pick the vector.
+        template <typename Compare, typename Allocator>
+        Logger(const std::string& scope, const std::set<std::shared_ptr<IOutput>, Compare, Allocator>& outputs)
+        : Logger(scope, std::vector<std::shared_ptr<IOutput>>(outputs.begin(), outputs.end())) {}
+
+        template <typename Compare, typename Allocator>
+        Logger(const std::set<std::shared_ptr<IOutput>, Compare, Allocator>& outputs) : Logger("", outputs) {}
+
+        Logger(const Logger& other)
+        : mEnabledSeverities{other.enabledSeverities()}, mState{other.mState.get()} {}
+
+        Logger& operator=(const Logger& other) {
+            setEnabledSeverities(other.enabledSeverities());
+            auto state = other.mState.get();
+            mState.update([&](State& s) { s = state; });
+            return *this;
+        }
+
+        static std::unique_ptr<Logger>& global() {
+            static auto logger = std::unique_ptr<Logger>(new Logger({ConsoleOutput::global()}));
+            return logger;
+        }
+
+        // A logger for `name` within this logger's scope, e.g. "db.pool" for "pool" within "db". It shares
+        // the outputs of this logger instead of copying them, which makes it cheap to create, e.g. once per
+        // request. Outputs added to or removed from either logger later do not affect the other one. Its
+        // severities follow setScopeSeverities(), like those of any new logger.
+        Logger child(const std::string& name) const {
+            std::shared_ptr<const Scope> scope;
+            std::shared_ptr<const Outputs> outputs;
+            mState.read([&](const State& state) {
+                scope = state.scope;
+                outputs = state.outputs;
+            });
+
+            auto& registry = detail::ScopeRegistry::global();
+            return Logger{registry.intern(scope->name().empty() ? name : scope->name() + '.' + name), std::move(outputs)};
+        }
+
+        Stream log(ESeverity severity) { return Stream{this, severity}; }
+
+        Stream none()    { return log(ESeverity::None);    }
+        Stream info()    { return log(ESeverity::Info);    }
+        Stream debug()   { return log(ESeverity::Debug);   }
+        Stream warning() { return log(ESeverity::Warning); }
+        Stream error()   { return log(ESeverity::Error);   }
+        Stream success() { return log(ESeverity::Success); }
+
+        void log(ESeverity severity, const std::string& line) {
+            log(severity, line.data(), line.size());
+        }
+
+        void log(ESeverity severity, const char* text, size_t size, Fields fields = {}) {
+            if (!isEnabled(severity)) {
+                return;
+            }
+
+            if (statsEnabled()) {
+                mNumRecords.add(severity);
+            }
 
-    private:
-        std::ofstream mFile;
-    };
+            auto time = std::chrono::system_clock::now();
+            mState.read([&](const State& state) {
+                Record record = {severity, &state.scope->name(), text, size, time, detail::threadIndex(), fields};
+                for (auto& output : *state.outputs) {
+                    output->timedWriteRecord(record);
+                }
+            });
+        }
+
+        // Logs a binary record whose arguments are only rendered by outputs that need text. Usually
+        // called through TLOG_BINARY, which creates the EventFormat of every call site once.
+        template <typename... Args>
+        void logBinary(const EventFormat& format, const Args&... args) {
+            if (!isEnabled(format.severity())) {
+                return;
+            }
 
+            if (statsEnabled()) {
+                mNumRecords.add(format.severity());
+            }
 
-      /////////////////////////////////////////
-     /// Logger stuff for managing outputs ///
-    /////////////////////////////////////////
-    class Logger;
+            auto time = std::chrono::system_clock::now();
+            detail::ScratchString encoded;
+            detail::encodeArgs(encoded.get(), args...);
 
-    class Stream {
-    public:
-        Stream(Logger* logger, ESeverity severity)
-        : mLogger{logger}, mSeverity{severity}, mText{new std::ostringstream{}} {}
+            mState.read([&](const State& state) {
+                BinaryRecord record = {&format, &state.scope->name(), encoded.get().data(), encoded.get().size(), time, detail::threadIndex()};
+                for (auto& output : *state.outputs) {
+                    output->timedWriteBinary(record);
+                }
+            });
+        }
+
+        // Logs the result of `f()`, rendered like the arguments of logFormat(), if the severity is shown.
+        // Outputs that defer rendering, such as AsyncOutput, call `f` on their worker thread, which moves
+        // its cost off the logging thread; `f` must hence capture by value. All other outputs share a
+        // single call on the logging thread, e.g. `logDeferred(ESeverity::Debug, [state]() { return dump(state); })`.
+        template <typename F>
+        void logDeferred(ESeverity severity, F f) {
+            if (!isEnabled(severity)) {
+                return;
+            }
+
+            if (statsEnabled()) {
+                mNumRecords.add(severity);
+            }
+
+            auto time = std::chrono::system_clock::now();
+            detail::ScratchString text;
+            bool isRendered = false;
+            std::function<void(std::string&)> render;
+
+            mState.read([&](const State& state) {
+                unsigned thread = detail::threadIndex();
+                for (auto& output : *state.outputs) {
+                    if (output->defersRendering()) {
+                        if (!render) {
+                            render = [f](std::string& out) { detail::appendValue(out, f()); };
+                        }
+                        output->timedWriteDeferred({severity, &state.scope->name(), &render, time, thread});
+                    } else {
+                        if (!isRendered) {
+                            detail::appendValue(text.get(), f());
+                            isRendered = true;
+                        }
+                        output->timedWriteRecord({severity, &state.scope->name(), text.get().data(), text.get().size(), time, thread, {}});
+                    }
+                }
+            });
+        }
+
+        // Replaces the `{}` placeholders of `format` by the arguments, e.g. `logFormat(ESeverity::Info,
+        // "took {} ms for {}", ms, key)`. Write `{{` and `}}` for literal braces. Placeholders without an
+        // argument are kept and extra arguments are appended; TLOG_FORMAT rules out both at compile time.
+        template <typename... Args>
+        void logFormat(ESeverity severity, const char* format, const Args&... args) {
+            if (!isEnabled(severity)) {
+                return;
+            }
+
+            detail::ScratchString text;
+            detail::formatTo(text.get(), format, args...);
+            log(severity, text.get().data(), text.get().size());
+        }
+
+        void none(const std::string& line)    { log(ESeverity::None,    line); }
+        void info(const std::string& line)    { log(ESeverity::Info,    line); }
+        void debug(const std::string& line)   { log(ESeverity::Debug,   line); }
+        void warning(const std::string& line) { log(ESeverity::Warning, line); }
+        void error(const std::string& line)   { log(ESeverity::Error,   line); }
+        void success(const std::string& line) { log(ESeverity::Success, line); }
 
-        Stream(Stream&& other) = default;
-        ~Stream();
+        // Formatting overloads of the above. They take at least one argument, so that lines without
+        // any keep being printed verbatim.
+        template <typename T, typename... Args> void none(const char* format, const T& arg, const Args&... args)    { logFormat(ESeverity::None,    format, arg, args...); }
+        template <typename T, typename... Args> void info(const char* format, const T& arg, const Args&... args)    { logFormat(ESeverity::Info,    format, arg, args...); }
+        template <typename T, typename... Args> void debug(const char* format, const T& arg, const Args&... args)   { logFormat(ESeverity::Debug,   format, arg, args...); }
+        template <typename T, typename... Args> void warning(const char* format, const T& arg, const Args&... args) { logFormat(ESeverity::Warning, format, arg, args...); }
+        template <typename T, typename... Args> void error(const char* format, const T& arg, const Args&... args)   { logFormat(ESeverity::Error,   format, arg, args...); }
+        template <typename T, typename... Args> void success(const char* format, const T& arg, const Args&... args) { logFormat(ESeverity::Success, format, arg, args...); }
+
+        Progress progress(uint64_t total, ProgressThrottle throttle = ProgressThrottle::every()) {
+            return Progress{this, total, throttle};
+        }
 
-        Stream& operator=(Stream&& other) = default;
+        void flush() {
+            mState.read([](const State& state) {
+                for (auto& output : *state.outputs) {
+                    output->flush();
+                }
+            });
+        }
 
         template <typename T>
-        Stream& operator<<(const T& elem) {
-            *mText << elem;
-            return *this;
+        void progress(uint64_t current, uint64_t total, T duration) {
+            if (!isEnabled(ESeverity::Progress)) {
+                return;
+            }
+
+            duration_t dur = std::chrono::duration_cast<duration_t>(duration);
+            mState.read([&](const State& state) {
+                for (auto& output : *state.outputs) {
+                    output->writeProgress(state.scope->name(), current, total, dur);
+                }
+            });
+        }
+
+        // A single relaxed load, cheap enough to be checked before any formatting happens.
+        bool isEnabled(ESeverity severity) const {
+            return (mEnabledSeverities.load(std::memory_order_relaxed) & severityMask(severity)) != 0;
+        }
+
+        void hideSeverity(ESeverity severity) { mEnabledSeverities.fetch_and(~severityMask(severity), std::memory_order_relaxed); }
+        void showSeverity(ESeverity severity) { mEnabledSeverities.fetch_or(severityMask(severity), std::memory_order_relaxed); }
+
+        std::set<ESeverity> hiddenSeverities() const {
+            std::set<ESeverity> result;
+            for (auto severity : {ESeverity::None, ESeverity::Info, ESeverity::Debug, ESeverity::Warning, ESeverity::Error, ESeverity::Success, ESeverity::Progress}) {
+                if (!isEnabled(severity)) {
+                    result.insert(severity);
+                }
+            }
+            return result;
+        }
+
+        // Bitmask of severityMask() values.
+        uint32_t enabledSeverities() const { return mEnabledSeverities.load(std::memory_order_relaxed); }
+        void setEnabledSeverities(uint32_t mask) { mEnabledSeverities.store(mask, std::memory_order_relaxed); }
+
+        void addOutput(const std::shared_ptr<IOutput>& output) {
+            mState.update([&](State& state) {
+                auto outputs = *state.outputs;
+                outputs.push_back(output);
+                state.outputs = makeOutputs(outputs);
+            });
+        }
+
+        void removeOutput(const std::shared_ptr<IOutput>& output) {
+            mState.update([&](State& state) {
+                auto outputs = *state.outputs;
+                outputs.erase(std::remove(outputs.begin(), outputs.end(), output), outputs.end());
+                state.outputs = std::make_shared<const Outputs>(std::move(outputs));
+            });
+        }
+
+        // In the order in which records are handed to them.
+        std::vector<std::shared_ptr<IOutput>> outputs() const { return *mState.get().outputs; }
+
+        // Keeps the severities.
+        void setScope(const std::string& scope) {
+            auto interned = detail::ScopeRegistry::global().intern(scope);
+            mState.update([&](State& state) { state.scope = interned; });
+        }
+
+        std::string scope() const { return mState.get().scope->name(); }
+        uint64_t scopeId() const { return mState.get().scope->id(); }
+
+        // Records of this logger and the stats of its outputs, as counted while enableStats() was on.
+        LoggerStats stats() const {
+            LoggerStats result;
+            for (size_t i = 0; i < LoggerStats::NUM_SEVERITIES; ++i) {
+                result.numRecords[i] = mNumRecords.counts[i].load(std::memory_order_relaxed);
+            }
+
+            mState.read([&](const State& state) {
+                result.scope = state.scope->name();
+                for (auto& output : *state.outputs) {
+                    result.outputs.push_back(output->stats());
+                }
+            });
+            return result;
         }
 
     private:
-        Logger* mLogger;
-        ESeverity mSeverity;
-        std::unique_ptr<std::ostringstream> mText;
+        // Contiguous, such that logging does not chase pointers through a tree. Immutable, such that child
+        // loggers may share it.
+        using Outputs = std::vector<std::shared_ptr<IOutput>>;
+
+        struct State {
+            std::shared_ptr<const Scope> scope;
+            std::shared_ptr<const Outputs> outputs;
+        };
+
+        Logger(std::shared_ptr<const Scope> scope, std::shared_ptr<const Outputs> outputs)
+        : mEnabledSeverities{detail::ScopeRegistry::global().severities(scope->name())}, mState{State{std::move(scope), std::move(outputs)}} {}
+
+        // Drops duplicates.
+        static std::shared_ptr<const Outputs> makeOutputs(const Outputs& outputs) {
+            return std::make_shared<const Outputs>(detail::uniqueOutputs(outputs));
+        }
+
+        std::atomic<uint32_t> mEnabledSeverities;
+        detail::Published<State> mState;
+        detail::SeverityCounters mNumRecords;
     };
 
-    class Progress {
+    // Reports the stats of a logger periodically, by default as an info line logged through the logger
+    // itself. Other reports, e.g. LoggerStats::toPrometheus() written to a file for a metrics collector,
+    // can be plugged in. Enables stats.
+    class StatsReporter {
     public:
-        Progress(Logger* logger, uint64_t total)
-        : mLogger{logger}, mStartTime{std::chrono::steady_clock::now()}, mTotal{total} {
-            update(0); // Initial print with 0 progress.
+        StatsReporter(
+            Logger& logger,
+            std::chrono::milliseconds interval,
+            std::function<void(const LoggerStats&)> report = {}
+        ) : mLogger(logger), mReport{std::move(report)} {
+            if (!mReport) {
+                mReport = [this](const LoggerStats& stats) { mLogger.info(stats.toString()); };
+            }
+
+            enableStats();
+            mTask.start(interval, [this]() { mReport(mLogger.stats()); });
         }
 
-        void update(uint64_t current);
-        duration_t duration() const {
-            return std::chrono::duration_cast<duration_t>(std::chrono::steady_clock::now() - mStartTime);
+        StatsReporter(const StatsReporter&) = delete;
+        StatsReporter& operator=(const StatsReporter&) = delete;
+
+        ~StatsReporter() {
+            mTask.stop();
         }
 
     private:
-        Logger* mLogger;
-        std::chrono::steady_clock::time_point mStartTime;
-        uint64_t mTotal;
-        uint64_t mCurrent;
+        Logger& mLogger;
+        std::function<void(const LoggerStats&)> mReport;
+        detail::PeriodicTask mTask;
     };
 
-    class Logger {
+    // A logger whose outputs are fixed at compile time, e.g. `StaticLogger<ConsoleOutput, FileOutput>`.
+    // Records are handed to every output by a direct call instead of through the IOutput vtable, so
+    // the compiler may inline the outputs into the call site. In exchange, neither the scope nor the
+    // outputs can change after construction. makeStaticLogger() deduces the output types.
+    template <typename... Outputs>
+    class StaticLogger {
+        static_assert(sizeof...(Outputs) > 0, "StaticLogger needs at least one output");
+
     public:
-        Logger(std::string scope = "", std::set<std::shared_ptr<IOutput>> outputs = {ConsoleOutput::global()})
-        : mOutputs{outputs}, mScope{scope} {
-#ifdef NDEBUG
-            hideSeverity(ESeverity::Debug);
-#endif
-        }
+        using Stream = BasicStream<StaticLogger>;
 
-        Logger(std::set<std::shared_ptr<IOutput>> outputs) : Logger("", outputs) {}
+        // The severities follow setScopeSeverities().
+        StaticLogger(std::string scope, std::shared_ptr<Outputs>... outputs)
+        : mEnabledSeverities{detail::ScopeRegistry::global().severities(scope)}, mScope{std::move(scope)}, mOutputs{std::move(outputs)...} {}
 
-        static std::unique_ptr<Logger>& global() {
-            static auto logger = std::unique_ptr<Logger>(new Logger({ConsoleOutput::global()}));
-            return logger;
-        }
+        StaticLogger(const StaticLogger& other)
+        : mEnabledSeverities{other.enabledSeverities()}, mScope{other.mScope}, mOutputs{other.mOutputs} {}
+
+        StaticLogger& operator=(const StaticLogger&) = delete;
 
         Stream log(ESeverity severity) { return Stream{this, severity}; }
 
@@ -459,13 +6769,43 @@ namespace tlog {
         Stream success() { return log(ESeverity::Success); }
 
         void log(ESeverity severity, const std::string& line) {
-            if (mHiddenSeverities.count(severity)) {
+            log(severity, line.data(), line.size());
+        }
+
+        void log(ESeverity severity, const char* text, size_t size, Fields fields = {}) {
+            if (!isEnabled(severity)) {
                 return;
             }
 
-            for (auto& output : mOutputs) {
-                output->writeLine(mScope, severity, line);
+            Record record = {severity, &mScope, text, size, std::chrono::system_clock::now(), detail::threadIndex(), fields};
+            forEachOutput(WriteRecord{record});
+        }
+
+        // See Logger::logBinary().
+        template <typename... Args>
+        void logBinary(const EventFormat& format, const Args&... args) {
+            if (!isEnabled(format.severity())) {
+                return;
+            }
+
+            auto time = std::chrono::system_clock::now();
+            detail::ScratchString encoded;
+            detail::encodeArgs(encoded.get(), args...);
+
+            BinaryRecord record = {&format, &mScope, encoded.get().data(), encoded.get().size(), time, detail::threadIndex()};
+            forEachOutput(WriteBinary{record});
+        }
+
+        // See Logger::logFormat().
+        template <typename... Args>
+        void logFormat(ESeverity severity, const char* format, const Args&... args) {
+            if (!isEnabled(severity)) {
+                return;
             }
+
+            detail::ScratchString text;
+            detail::formatTo(text.get(), format, args...);
+            log(severity, text.get().data(), text.get().size());
         }
 
         void none(const std::string& line)    { log(ESeverity::None,    line); }
@@ -475,48 +6815,252 @@ namespace tlog {
         void error(const std::string& line)   { log(ESeverity::Error,   line); }
         void success(const std::string& line) { log(ESeverity::Success, line); }
 
-        Progress progress(uint64_t total) {
-            return Progress{this, total};
-        }
+        template <typename T, typename... Args> void none(const char* format, const T& arg, const Args&... args)    { logFormat(ESeverity::None,    format, arg, args...); }
+        template <typename T, typename... Args> void info(const char* format, const T& arg, const Args&... args)    { logFormat(ESeverity::Info,    format, arg, args...); }
+        template <typename T, typename... Args> void debug(const char* format, const T& arg, const Args&... args)   { logFormat(ESeverity::Debug,   format, arg, args...); }
+        template <typename T, typename... Args> void warning(const char* format, const T& arg, const Args&... args) { logFormat(ESeverity::Warning, format, arg, args...); }
+        template <typename T, typename... Args> void error(const char* format, const T& arg, const Args&... args)   { logFormat(ESeverity::Error,   format, arg, args...); }
+        template <typename T, typename... Args> void success(const char* format, const T& arg, const Args&... args) { logFormat(ESeverity::Success, format, arg, args...); }
 
         template <typename T>
         void progress(uint64_t current, uint64_t total, T duration) {
-            if (mHiddenSeverities.count(ESeverity::Progress)) {
+            if (!isEnabled(ESeverity::Progress)) {
                 return;
             }
 
-            duration_t dur = std::chrono::duration_cast<duration_t>(duration);
-            for (auto& output : mOutputs) {
-                output->writeProgress(mScope, current, total, dur);
-            }
+            forEachOutput(WriteProgress{mScope, current, total, std::chrono::duration_cast<duration_t>(duration)});
         }
 
-        void hideSeverity(ESeverity severity) { mHiddenSeverities.insert(severity); }
-        void showSeverity(ESeverity severity) { mHiddenSeverities.erase(severity); }
-        const std::set<ESeverity>& hiddenSeverities() const { return mHiddenSeverities; }
+        void flush() { forEachOutput(Flush{}); }
 
-        void addOutput(std::shared_ptr<IOutput>& output) { mOutputs.insert(output); }
-        void removeOutput(std::shared_ptr<IOutput>& output) { mOutputs.erase(output); }
-        const std::set<std::shared_ptr<IOutput>>& outputs() const { return mOutputs; }
+        bool isEnabled(ESeverity severity) const {
+            return (mEnabledSeverities.load(std::memory_order_relaxed) & severityMask(severity)) != 0;
+        }
+
+        void hideSeverity(ESeverity severity) { mEnabledSeverities.fetch_and(~severityMask(severity), std::memory_order_relaxed); }
+        void showSeverity(ESeverity severity) { mEnabledSeverities.fetch_or(severityMask(severity), std::memory_order_relaxed); }
 
-        void setScope(const std::string& scope) { mScope = scope; }
+        uint32_t enabledSeverities() const { return mEnabledSeverities.load(std::memory_order_relaxed); }
+        void setEnabledSeverities(uint32_t mask) { mEnabledSeverities.store(mask, std::memory_order_relaxed); }
+
+        const std::tuple<std::shared_ptr<Outputs>...>& outputs() const { return mOutputs; }
         const std::string& scope() const { return mScope; }
 
     private:
-        std::set<ESeverity> mHiddenSeverities;
-        std::set<std::shared_ptr<IOutput>> mOutputs;
-        std::string mScope;
-    };
+        // Qualified calls, which bypass the vtable. C++11 lacks generic lambdas.
+        struct WriteRecord {
+            const Record& record;
+            template <typename O> void operator()(O& output) const { output.O::writeRecord(record); }
+        };
+
+        struct WriteBinary {
+            const BinaryRecord& record;
+            template <typename O> void operator()(O& output) const { output.O::writeBinary(record); }
+        };
+
+        struct WriteProgress {
+            const std::string& scope;
+            uint64_t current;
+            uint64_t total;
+            duration_t duration;
+            template <typename O> void operator()(O& output) const { output.O::writeProgress(scope, current, total, duration); }
+        };
+
+        struct Flush {
+            template <typename O> void operator()(O& output) const { output.O::flush(); }
+        };
 
-    inline Stream::~Stream() {
-        if (mText) {
-            mLogger->log(mSeverity, mText->str());
+        template <typename F>
+        void forEachOutput(const F& f) {
+            forEachOutput(f, typename detail::MakeIndexSequence<sizeof...(Outputs)>::type{});
         }
+
+        template <typename F, size_t... I>
+        void forEachOutput(const F& f, detail::IndexSequence<I...>) {
+            int expand[] = {((void)f(*std::get<I>(mOutputs)), 0)...};
+            (void)expand;
+        }
+
+        std::atomic<uint32_t> mEnabledSeverities;
+        const std::string mScope;
+        std::tuple<std::shared_ptr<Outputs>...> mOutputs;
+    };
+
+    template <typename... Outputs>
+    StaticLogger<Outputs...> makeStaticLogger(std::string scope, std::shared_ptr<Outputs>... outputs) {
+        return StaticLogger<Outputs...>{std::move(scope), std::move(outputs)...};
     }
 
+    // Shows several progress bars at once, e.g. of concurrent downloads, in a region at the bottom of
+    // the console. Regular log lines appear above it. A background task redraws the region at a fixed
+    // rate, only rewriting the bars that changed, so the cost of drawing does not depend on how often
+    // the bars are updated. Finished bars move above the region for good.
+    class MultiProgress : public detail::ConsoleRegion {
+    public:
+        MultiProgress(
+            std::shared_ptr<ConsoleOutput> console = ConsoleOutput::global(),
+            std::chrono::milliseconds frameInterval = std::chrono::milliseconds{66}
+        ) : mConsole{std::move(console)} {
+            mConsole->attachRegion(this);
+            mRedrawTask.start(frameInterval, [this]() { mConsole->redrawRegions(); });
+        }
+
+        MultiProgress(const MultiProgress&) = delete;
+        MultiProgress& operator=(const MultiProgress&) = delete;
+
+        virtual ~MultiProgress() {
+            mRedrawTask.stop();
+            mConsole->detachRegion(this);
+        }
+
+        // Adds a bar labeled `label`. The returned Progress must not outlive the MultiProgress. Updates
+        // only record the new state; drawing is rate-limited by the frame interval, hence no throttle.
+        Progress add(const std::string& label, uint64_t total, ProgressThrottle throttle = ProgressThrottle::none()) {
+            std::shared_ptr<BarOutput> output;
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                output = std::make_shared<BarOutput>(this, mBars.size());
+
+                std::unique_ptr<BarState> bar{new BarState};
+                bar->bar = {label, 0, total, duration_t{0}, std::chrono::system_clock::now()};
+                bar->logger.reset(new Logger{label, {output}});
+                mBars.emplace_back(std::move(bar));
+            }
+
+            return output->logger()->progress(total, throttle);
+        }
+
+        void collect(std::vector<Bar>& active, std::vector<Bar>& finished) override {
+            std::lock_guard<std::mutex> lock{mMutex};
+            for (auto& bar : mBars) {
+                if (bar->reported) {
+                    continue;
+                }
+
+                if (bar->bar.current >= bar->bar.total) {
+                    finished.push_back(bar->bar);
+                    bar->reported = true;
+                } else {
+                    active.push_back(bar->bar);
+                }
+            }
+        }
+
+    private:
+        struct BarState {
+            Bar bar;
+            bool reported = false;
+            std::unique_ptr<Logger> logger;
+        };
+
+        // Records the latest state of one bar. Regular lines logged through the bar's logger go
+        // straight to the console.
+        class BarOutput : public IOutput {
+        public:
+            BarOutput(MultiProgress* parent, size_t index) : mParent{parent}, mIndex{index} {}
+
+            void writeLine(const std::string& scope, ESeverity severity, const std::string& line) override {
+                mParent->mConsole->writeLine(scope, severity, line);
+            }
+
+            void writeProgress(const std::string&, uint64_t current, uint64_t total, duration_t duration) override {
+                checkProgress(current, total);
+
+                std::lock_guard<std::mutex> lock{mParent->mMutex};
+                auto& bar = mParent->mBars[mIndex]->bar;
+                bar.current = current;
+                bar.total = total;
+                bar.duration = duration;
+                bar.time = std::chrono::system_clock::now();
+            }
+
+            Logger* logger() {
+                std::lock_guard<std::mutex> lock{mParent->mMutex};
+                return mParent->mBars[mIndex]->logger.get();
+            }
+
+        private:
+            MultiProgress* mParent;
+            size_t mIndex;
+        };
+
+        std::shared_ptr<ConsoleOutput> mConsole;
+
+        // Guards mBars. Locked after the console's lock while drawing.
+        std::mutex mMutex;
+        std::vector<std::unique_ptr<BarState>> mBars;
+
+        detail::PeriodicTask mRedrawTask;
+    };
+
     inline void Progress::update(uint64_t current) {
-        mCurrent = current;
-        mLogger->progress(current, mTotal, duration());
+        State& state = *mState;
+        state.current.store(current, std::memory_order_relaxed);
+
+        if (current < mTotal && current < state.nextValue.load(std::memory_order_relaxed)) {
+            return;
+        }
+
+        render(current, current >= mTotal);
+    }
+
+    inline void Progress::advance(uint64_t amount) {
+        State& state = *mState;
+        auto& count = state.shards[detail::threadIndex() % NUM_SHARDS].count;
+        uint64_t previous = count.fetch_add(amount, std::memory_order_relaxed);
+
+        // Only consider rendering when this shard crosses a multiple of its share of the minimum delta.
+        uint64_t stride = std::max<uint64_t>(mMinDelta / NUM_SHARDS, 1);
+        if (previous / stride == (previous + amount) / stride) {
+            return;
+        }
+
+        // Summing the shards reads the cache lines of all threads, so only the thread that renders does.
+        std::chrono::steady_clock::duration elapsed;
+        bool isTooEarly;
+        if (!claimRendering(elapsed, isTooEarly)) {
+            return;
+        }
+
+        uint64_t current = this->current();
+        state.nextValue.store(current + mMinDelta, std::memory_order_relaxed);
+        mLogger->progress(current, mTotal, std::chrono::duration_cast<duration_t>(elapsed));
+    }
+
+    inline void Progress::finish() {
+        render(current(), true);
+    }
+
+    inline bool Progress::claimRendering(std::chrono::steady_clock::duration& elapsed, bool& isTooEarly) {
+        State& state = *mState;
+        elapsed = std::chrono::steady_clock::now() - mStartTime;
+
+        // Of several threads that pass the checks at once, only one renders.
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        int64_t nextTime = state.nextTime.load(std::memory_order_relaxed);
+        isTooEarly = now < nextTime;
+        return !isTooEarly && state.nextTime.compare_exchange_strong(nextTime, now + mMinInterval, std::memory_order_relaxed);
+    }
+
+    inline void Progress::render(uint64_t current, bool force) {
+        State& state = *mState;
+        std::chrono::steady_clock::duration elapsed;
+        if (force) {
+            elapsed = std::chrono::steady_clock::now() - mStartTime;
+        } else {
+            bool isTooEarly;
+            if (!claimRendering(elapsed, isTooEarly)) {
+                if (isTooEarly) {
+                    // Do not look at the clock again before some more progress was made.
+                    state.nextValue.store(current + std::max<uint64_t>(mMinDelta, 1), std::memory_order_relaxed);
+                }
+                return;
+            }
+
+            state.nextValue.store(current + mMinDelta, std::memory_order_relaxed);
+        }
+
+        mLogger->progress(current, mTotal, std::chrono::duration_cast<duration_t>(elapsed));
     }
 
     inline Stream log(ESeverity severity) { return Logger::global()->log(severity); }
@@ -532,6 +7076,11 @@ namespace tlog {
         Logger::global()->log(severity, line);
     }
 
+    template <typename F>
+    void logDeferred(ESeverity severity, F f) {
+        Logger::global()->logDeferred(severity, std::move(f));
+    }
+
     inline void none(const std::string& line)    { Logger::global()->none(line);    }
     inline void info(const std::string& line)    { Logger::global()->info(line);    }
     inline void debug(const std::string& line)   { Logger::global()->debug(line);   }
@@ -539,10 +7088,269 @@ namespace tlog {
     inline void error(const std::string& line)   { Logger::global()->error(line);   }
     inline void success(const std::string& line) { Logger::global()->success(line); }
 
-    inline Progress progress(uint64_t total) { return Logger::global()->progress(total); }
+    template <typename T, typename... Args> void none(const char* format, const T& arg, const Args&... args)    { Logger::global()->none(format, arg, args...);    }
+    template <typename T, typename... Args> void info(const char* format, const T& arg, const Args&... args)    { Logger::global()->info(format, arg, args...);    }
+    template <typename T, typename... Args> void debug(const char* format, const T& arg, const Args&... args)   { Logger::global()->debug(format, arg, args...);   }
+    template <typename T, typename... Args> void warning(const char* format, const T& arg, const Args&... args) { Logger::global()->warning(format, arg, args...); }
+    template <typename T, typename... Args> void error(const char* format, const T& arg, const Args&... args)   { Logger::global()->error(format, arg, args...);   }
+    template <typename T, typename... Args> void success(const char* format, const T& arg, const Args&... args) { Logger::global()->success(format, arg, args...); }
+
+    inline Progress progress(uint64_t total, ProgressThrottle throttle = ProgressThrottle::every()) {
+        return Logger::global()->progress(total, throttle);
+    }
 
     template <typename T>
     void progress(uint64_t current, uint64_t total, T duration) {
         Logger::global()->progress(current, total, duration);
     }
+
+    inline void flush() { Logger::global()->flush(); }
+}
+
+// Severities which the TLOG_* macros below compile in. Calls of all other severities are removed
+// by the compiler, including the evaluation of their arguments. Defaults to everything but debug
+// messages in release builds. Use tlog::severityMask() to assemble a custom value.
+#ifndef TLOG_COMPILED_SEVERITIES
+#   ifdef NDEBUG
+#       define TLOG_COMPILED_SEVERITIES (~::tlog::severityMask(::tlog::ESeverity::Debug))
+#   else
+#       define TLOG_COMPILED_SEVERITIES (::tlog::ALL_SEVERITIES)
+#   endif
+#endif
+
+namespace tlog {
+    inline constexpr bool isCompiledIn(ESeverity severity) {
+        return (TLOG_COMPILED_SEVERITIES & severityMask(severity)) != 0;
+    }
+}
+
+// Unlike the functions above, these macros do not evaluate anything to the right of `<<` if the
+// severity is hidden, e.g. `TLOG_DEBUG() << expensiveToString(x);`.
+#define TLOG_LOG(logger, severity) \
+    if (!(::tlog::isCompiledIn(severity) && (logger).isEnabled(severity))) {} else (logger).log(severity)
+
+#define TLOG_NONE()    TLOG_LOG(*::tlog::Logger::global(), ::tlog::ESeverity::None)
+#define TLOG_INFO()    TLOG_LOG(*::tlog::Logger::global(), ::tlog::ESeverity::Info)
+#define TLOG_DEBUG()   TLOG_LOG(*::tlog::Logger::global(), ::tlog::ESeverity::Debug)
+#define TLOG_WARNING() TLOG_LOG(*::tlog::Logger::global(), ::tlog::ESeverity::Warning)
+#define TLOG_ERROR()   TLOG_LOG(*::tlog::Logger::global(), ::tlog::ESeverity::Error)
+#define TLOG_SUCCESS() TLOG_LOG(*::tlog::Logger::global(), ::tlog::ESeverity::Success)
+
+namespace tlog {
+    namespace detail {
+        // Drops the format string, which TLOG_BINARY already stored in `format`.
+        template <typename L, typename... Args>
+        void logBinary(L& logger, const EventFormat& format, const char*, const Args&... args) {
+            logger.logBinary(format, args...);
+        }
+    }
+}
+
+#define TLOG_DETAIL_EXPAND(x) x
+#define TLOG_DETAIL_FIRST(first, ...) first
+
+// Fails to compile unless the format string, the first of the arguments, is a literal whose `{}`
+// placeholders match the remaining arguments.
+#define TLOG_DETAIL_CHECK_FORMAT(...) \
+    static_assert( \
+        ::tlog::detail::countPlaceholders(TLOG_DETAIL_EXPAND(TLOG_DETAIL_FIRST(__VA_ARGS__, ~))) == \
+        decltype(::tlog::detail::countArgs(__VA_ARGS__))::value - 1, \
+        "The {} placeholders of the format string do not match the arguments." \
+    )
+
+// Logs a formatted line, e.g. `TLOG_FORMAT(logger, ::tlog::ESeverity::Info, "took {} ms for {}", ms, key);`,
+// after checking the format string at compile time. Like TLOG_LOG, nothing is evaluated if the
+// severity is hidden.
+#define TLOG_FORMAT(logger, severity, ...) \
+    do { \
+        TLOG_DETAIL_CHECK_FORMAT(__VA_ARGS__); \
+        if (::tlog::isCompiledIn(severity) && (logger).isEnabled(severity)) { \
+            (logger).logFormat(severity, __VA_ARGS__); \
+        } \
+    } while (false)
+
+#define TLOG_NONEF(...)    TLOG_FORMAT(*::tlog::Logger::global(), ::tlog::ESeverity::None,    __VA_ARGS__)
+#define TLOG_INFOF(...)    TLOG_FORMAT(*::tlog::Logger::global(), ::tlog::ESeverity::Info,    __VA_ARGS__)
+#define TLOG_DEBUGF(...)   TLOG_FORMAT(*::tlog::Logger::global(), ::tlog::ESeverity::Debug,   __VA_ARGS__)
+#define TLOG_WARNINGF(...) TLOG_FORMAT(*::tlog::Logger::global(), ::tlog::ESeverity::Warning, __VA_ARGS__)
+#define TLOG_ERRORF(...)   TLOG_FORMAT(*::tlog::Logger::global(), ::tlog::ESeverity::Error,   __VA_ARGS__)
+#define TLOG_SUCCESSF(...) TLOG_FORMAT(*::tlog::Logger::global(), ::tlog::ESeverity::Success, __VA_ARGS__)
+
+// Logs a binary record, e.g. `TLOG_BINARY(logger, ::tlog::ESeverity::Info, "{} of {} done", i, n);`.
+// The format string must be a literal and the severity the same on every call.
+#define TLOG_BINARY(logger, severity, ...) \
+    do { \
+        TLOG_DETAIL_CHECK_FORMAT(__VA_ARGS__); \
+        if (::tlog::isCompiledIn(severity) && (logger).isEnabled(severity)) { \
+            static const ::tlog::EventFormat tlogEventFormat{ \
+                severity, __FILE__, __LINE__, TLOG_DETAIL_EXPAND(TLOG_DETAIL_FIRST(__VA_ARGS__, ~)) \
+            }; \
+            ::tlog::detail::logBinary((logger), tlogEventFormat, __VA_ARGS__); \
+        } \
+    } while (false)
+
+#define TLOG_BINARY_NONE(...)    TLOG_BINARY(*::tlog::Logger::global(), ::tlog::ESeverity::None,    __VA_ARGS__)
+#define TLOG_BINARY_INFO(...)    TLOG_BINARY(*::tlog::Logger::global(), ::tlog::ESeverity::Info,    __VA_ARGS__)
+#define TLOG_BINARY_DEBUG(...)   TLOG_BINARY(*::tlog::Logger::global(), ::tlog::ESeverity::Debug,   __VA_ARGS__)
+#define TLOG_BINARY_WARNING(...) TLOG_BINARY(*::tlog::Logger::global(), ::tlog::ESeverity::Warning, __VA_ARGS__)
+#define TLOG_BINARY_ERROR(...)   TLOG_BINARY(*::tlog::Logger::global(), ::tlog::ESeverity::Error,   __VA_ARGS__)
+#define TLOG_BINARY_SUCCESS(...) TLOG_BINARY(*::tlog::Logger::global(), ::tlog::ESeverity::Success, __VA_ARGS__)
+
+namespace tlog {
+    // How often a call site of TLOG_LIMITED or TLOG_FORMAT_LIMITED logs. Suppressed calls are counted
+    // and reported by a summary record of the same severity, at most once per `summaryInterval`, when
+    // the call site is reached again after the interval.
+    struct RateLimit {
+        enum class EKind {
+            PerSecond,
+            EveryNth,
+            FirstN,
+        };
+
+        EKind kind;
+        uint32_t n;
+        std::chrono::milliseconds summaryInterval;
+
+        // At most `n` records per second, of which all may come in a single burst.
+        static RateLimit perSecond(uint32_t n, std::chrono::milliseconds summaryInterval = std::chrono::seconds{1}) {
+            if (n == 0) {
+                throw std::invalid_argument{"RateLimit: must allow at least one record per second."};
+            }
+            return {EKind::PerSecond, n, summaryInterval};
+        }
+
+        // The 1st, (n+1)th, (2n+1)th, ... record.
+        static RateLimit everyNth(uint32_t n, std::chrono::milliseconds summaryInterval = std::chrono::seconds{1}) {
+            if (n == 0) {
+                throw std::invalid_argument{"RateLimit: n must be positive."};
+            }
+            return {EKind::EveryNth, n, summaryInterval};
+        }
+
+        static RateLimit firstN(uint32_t n, std::chrono::milliseconds summaryInterval = std::chrono::seconds{1}) {
+            return {EKind::FirstN, n, summaryInterval};
+        }
+    };
+
+    namespace detail {
+        // The state of a single rate-limited call site. Lives in a static of the call site and is
+        // shared by all threads that reach it, so all of it is atomic.
+        class RateLimiter {
+        public:
+            RateLimiter(const RateLimit& limit, const char* file, int line)
+            : mLimit{limit}, mFile{file}, mLine{line}, mSummaryInterval{toNanoseconds(limit.summaryInterval)} {
+                if (limit.kind == RateLimit::EKind::PerSecond) {
+                    mEmissionInterval = 1000000000ll / limit.n;
+                }
+                mNextSummaryTime.store(now() + mSummaryInterval, std::memory_order_relaxed);
+            }
+
+            // Whether the current call should log. Logs the summary of suppressed calls through `logger`
+            // if it is due.
+            template <typename L>
+            bool allow(L& logger, ESeverity severity) {
+                if (tryAcquire()) {
+                    return true;
+                }
+
+                mNumSuppressed.fetch_add(1, std::memory_order_relaxed);
+
+                int64_t time = now();
+                int64_t nextSummaryTime = mNextSummaryTime.load(std::memory_order_relaxed);
+                if (time >= nextSummaryTime &&
+                    mNextSummaryTime.compare_exchange_strong(nextSummaryTime, time + mSummaryInterval, std::memory_order_relaxed)) {
+                    uint64_t numSuppressed = mNumSuppressed.exchange(0, std::memory_order_relaxed);
+                    std::string summary = "Suppressed ";
+                    appendUnsigned(summary, numSuppressed);
+                    summary += numSuppressed == 1 ? " similar message from " : " similar messages from ";
+                    summary += mFile;
+                    summary += ':';
+                    appendSigned(summary, mLine);
+                    logger.log(severity, summary);
+                }
+
+                return false;
+            }
+
+        private:
+            static int64_t toNanoseconds(std::chrono::steady_clock::duration duration) {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+            }
+
+            static int64_t now() {
+                return toNanoseconds(std::chrono::steady_clock::now().time_since_epoch());
+            }
+
+            bool tryAcquire() {
+                switch (mLimit.kind) {
+                    case RateLimit::EKind::PerSecond: {
+                        // A token bucket in a single atomic: the time at which the bucket will be full
+                        // again ("generic cell rate algorithm"). Every record pushes it back by one
+                        // emission interval; records that would push it more than `n` intervals into
+                        // the future are suppressed.
+                        int64_t time = now();
+                        int64_t fullTime = mFullTime.load(std::memory_order_relaxed);
+                        for (;;) {
+                            int64_t newFullTime = std::max(fullTime, time) + mEmissionInterval;
+                            if (newFullTime - time > mEmissionInterval * mLimit.n) {
+                                return false;
+                            }
+
+                            if (mFullTime.compare_exchange_weak(fullTime, newFullTime, std::memory_order_relaxed)) {
+                                return true;
+                            }
+                        }
+                    }
+                    case RateLimit::EKind::EveryNth:
+                        return mCount.fetch_add(1, std::memory_order_relaxed) % mLimit.n == 0;
+                    case RateLimit::EKind::FirstN:
+                        // Stops counting once suppressing, such that the counter cannot wrap around.
+                        return mCount.load(std::memory_order_relaxed) < mLimit.n &&
+                            mCount.fetch_add(1, std::memory_order_relaxed) < mLimit.n;
+                }
+                return true;
+            }
+
+            const RateLimit mLimit;
+            const char* const mFile;
+            const int mLine;
+            const int64_t mSummaryInterval;
+            int64_t mEmissionInterval = 0;
+
+            std::atomic<uint64_t> mCount{0};
+            std::atomic<int64_t> mFullTime{0};
+            std::atomic<uint64_t> mNumSuppressed{0};
+            std::atomic<int64_t> mNextSummaryTime{0};
+        };
+    }
 }
+
+// A rate-limited TLOG_LOG, e.g. `TLOG_LIMITED(logger, ::tlog::ESeverity::Warning, ::tlog::RateLimit::perSecond(10)) << ...;`.
+// Each use of the macro is a call site with its own limit, which is fixed by its first call.
+// Suppressed calls evaluate nothing to the right of `<<` and cost a few atomic operations.
+#define TLOG_LIMITED(logger, severity, limit) \
+    if (!(::tlog::isCompiledIn(severity) && (logger).isEnabled(severity))) {} else \
+    if (!([&]() -> ::tlog::detail::RateLimiter& { \
+        static ::tlog::detail::RateLimiter tlogRateLimiter{limit, __FILE__, __LINE__}; \
+        return tlogRateLimiter; \
+    }().allow((logger), severity))) {} else (logger).log(severity)
+
+#define TLOG_NONE_LIMITED(limit)    TLOG_LIMITED(*::tlog::Logger::global(), ::tlog::ESeverity::None,    limit)
+#define TLOG_INFO_LIMITED(limit)    TLOG_LIMITED(*::tlog::Logger::global(), ::tlog::ESeverity::Info,    limit)
+#define TLOG_DEBUG_LIMITED(limit)   TLOG_LIMITED(*::tlog::Logger::global(), ::tlog::ESeverity::Debug,   limit)
+#define TLOG_WARNING_LIMITED(limit) TLOG_LIMITED(*::tlog::Logger::global(), ::tlog::ESeverity::Warning, limit)
+#define TLOG_ERROR_LIMITED(limit)   TLOG_LIMITED(*::tlog::Logger::global(), ::tlog::ESeverity::Error,   limit)
+#define TLOG_SUCCESS_LIMITED(limit) TLOG_LIMITED(*::tlog::Logger::global(), ::tlog::ESeverity::Success, limit)
+
+// A rate-limited TLOG_FORMAT, e.g. `TLOG_FORMAT_LIMITED(logger, ::tlog::ESeverity::Warning, ::tlog::RateLimit::everyNth(100), "retrying {}", key);`.
+// Suppressed calls do not format.
+#define TLOG_FORMAT_LIMITED(logger, severity, limit, ...) \
+    do { \
+        TLOG_DETAIL_CHECK_FORMAT(__VA_ARGS__); \
+        if (::tlog::isCompiledIn(severity) && (logger).isEnabled(severity)) { \
+            static ::tlog::detail::RateLimiter tlogRateLimiter{limit, __FILE__, __LINE__}; \
+            if (tlogRateLimiter.allow((logger), severity)) { \
+                (logger).logFormat(severity, __VA_ARGS__); \
+            } \
+        } \
+    } while (false)
@@ -0,0 +1,372 @@
+// This file was developed by Thomas Müller <contact@tom94.net>.
+// It is published under the BSD 3-Clause License within the LICENSE.md file.
+
+// Measures the cost of logging: nanoseconds and heap allocations per call, and throughput.
+// Usage: tlog-bench [-t <seconds per benchmark>] [-j <max threads>] [<name filter>]
+//
+// The console benchmarks write to stdout, which is redirected to the null device, so results go
+// to stderr.
+
+#include "tinylogger/tinylogger.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#   define TLOG_BENCH_NULL_DEVICE "NUL"
+#else
+#   define TLOG_BENCH_NULL_DEVICE "/dev/null"
+#endif
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+    atomic<uint64_t> numAllocations{0};
+
+    // Keeps the results of benchmarked calls from being optimized away.
+    volatile size_t sink;
+}
+
+// Keeps GCC from inlining the replaced operators and mistaking their malloc() and free() for a mismatch.
+#ifdef __GNUC__
+#   define TLOG_BENCH_NOINLINE __attribute__((noinline))
+#else
+#   define TLOG_BENCH_NOINLINE
+#endif
+
+// Counts every heap allocation of the program.
+TLOG_BENCH_NOINLINE void* operator new(size_t size) {
+    numAllocations.fetch_add(1, memory_order_relaxed);
+    if (void* ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw bad_alloc{};
+}
+
+TLOG_BENCH_NOINLINE void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+TLOG_BENCH_NOINLINE void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+TLOG_BENCH_NOINLINE void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+namespace {
+    // Consumes records without writing them, so that only the cost of the logger remains.
+    class NullOutput : public tlog::IOutput {
+    public:
+        void writeLine(const string&, tlog::ESeverity, const string& line) override { mSize += line.size(); }
+        void writeRecord(const tlog::Record& record) override { mSize += record.size; }
+        void writeProgress(const string&, uint64_t, uint64_t, tlog::duration_t) override {}
+
+        size_t size() const { return mSize; }
+
+    private:
+        size_t mSize = 0;
+    };
+
+    struct Options {
+        duration<double> minTime{0.5};
+        size_t maxThreads = max(4u, thread::hardware_concurrency());
+        string filter;
+    } options;
+
+    void printHeader() {
+        fprintf(stderr, "%-44s %12s %12s %14s\n", "benchmark", "ns/op", "allocs/op", "ops/s");
+    }
+
+    void printResult(const string& name, uint64_t numOps, duration<double> elapsed, uint64_t allocations) {
+        double ns = duration_cast<duration<double, nano>>(elapsed).count();
+        fprintf(stderr, "%-44s %12.1f %12.2f %14.0f\n", name.c_str(), ns / numOps, (double)allocations / numOps, numOps / elapsed.count());
+    }
+
+    // Calls `body(n)`, which performs n operations, with growing n until it runs for the minimum time.
+    template <typename F>
+    void run(const string& name, F&& body) {
+        if (name.find(options.filter) == string::npos) {
+            return;
+        }
+
+        // Warms up caches and lazily initialized state, such as buffer pools.
+        body((uint64_t)100);
+
+        for (uint64_t n = 100;; n *= 4) {
+            uint64_t allocations = numAllocations.load();
+            auto start = steady_clock::now();
+            body(n);
+            duration<double> elapsed = steady_clock::now() - start;
+
+            if (elapsed >= options.minTime || n >= (1ull << 32)) {
+                printResult(name, n, elapsed, numAllocations.load() - allocations);
+                return;
+            }
+        }
+    }
+
+    // Each of `numThreads` threads performs `body(n)` at the same time. Reports the total throughput.
+    template <typename F>
+    void runThreads(const string& name, size_t numThreads, F&& body) {
+        if (name.find(options.filter) == string::npos) {
+            return;
+        }
+
+        body((uint64_t)100);
+
+        for (uint64_t n = 100;; n *= 4) {
+            atomic<size_t> numReady{0};
+            atomic<bool> go{false};
+            vector<thread> threads;
+            for (size_t i = 0; i < numThreads; ++i) {
+                threads.emplace_back([&]() {
+                    ++numReady;
+                    while (!go.load()) {
+                        this_thread::yield();
+                    }
+                    body(n);
+                });
+            }
+
+            while (numReady.load() < numThreads) {
+                this_thread::yield();
+            }
+
+            uint64_t allocations = numAllocations.load();
+            auto start = steady_clock::now();
+            go.store(true);
+            for (auto& t : threads) {
+                t.join();
+            }
+            duration<double> elapsed = steady_clock::now() - start;
+
+            if (elapsed >= options.minTime || n >= (1ull << 32)) {
+                printResult(name, n * numThreads, elapsed, numAllocations.load() - allocations);
+                return;
+            }
+        }
+    }
+
+    void benchmarkFrontend() {
+        auto output = make_shared<NullOutput>();
+        tlog::Logger logger{"bench", {output}};
+        logger.hideSeverity(tlog::ESeverity::Debug);
+        const string line = "The quick brown fox jumps over the lazy dog.";
+
+        run("stream: text and int", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                logger.info() << "Processed " << i << " items";
+            }
+        });
+
+        run("stream: double", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                logger.info() << "Took " << i * 0.25 << " seconds";
+            }
+        });
+
+        run("stream: kv fields", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                logger.info().kv("item", i).kv("ms", i * 0.25) << "Processed";
+            }
+        });
+
+        run("log(severity, string)", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                logger.log(tlog::ESeverity::Info, line);
+            }
+        });
+
+        run("logFormat: text and int", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                logger.info("Processed {} items", i);
+            }
+        });
+
+        run("TLOG_BINARY: text and int", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                TLOG_BINARY(logger, tlog::ESeverity::Info, "Processed {} items", i);
+            }
+        });
+
+        run("hidden severity: stream", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                logger.debug() << "Processed " << i << " items";
+            }
+        });
+
+        // Info is compiled in, so this measures the runtime check rather than an empty loop.
+        logger.hideSeverity(tlog::ESeverity::Info);
+        run("hidden severity: TLOG_FORMAT", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                TLOG_FORMAT(logger, tlog::ESeverity::Info, "Processed {} items", i);
+            }
+        });
+        logger.showSeverity(tlog::ESeverity::Info);
+
+        if (!tlog::isCompiledIn(tlog::ESeverity::Debug)) {
+            run("compiled-out severity: TLOG_FORMAT", [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) {
+                    TLOG_FORMAT(logger, tlog::ESeverity::Debug, "Processed {} items", i);
+                }
+            });
+        }
+
+        run("hidden severity: lazy", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                logger.debug() << "State: " << tlog::lazy([&]() { return line + line; });
+            }
+        });
+
+        run("TLOG_LIMITED: suppressed", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                TLOG_LIMITED(logger, tlog::ESeverity::Warning, tlog::RateLimit::firstN(1)) << "Processed " << i << " items";
+            }
+        });
+
+        auto staticLogger = tlog::makeStaticLogger("bench", output);
+        run("StaticLogger: stream", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                staticLogger.info() << "Processed " << i << " items";
+            }
+        });
+
+        run("Logger::child() of a scope in use", [&](uint64_t n) {
+            auto request = logger.child("request");
+            for (uint64_t i = 0; i < n; ++i) {
+                sink = logger.child("request").scopeId();
+            }
+        });
+
+        sink = output->size();
+    }
+
+    template <typename T>
+    void benchmarkOutput(const string& name, shared_ptr<T> output) {
+        tlog::Logger logger{"bench", {output}};
+        run(name, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                logger.info() << "Processed " << i << " items";
+            }
+            output->flush();
+        });
+    }
+
+    void benchmarkOutputs() {
+        benchmarkOutput("ConsoleOutput to null device", tlog::ConsoleOutput::global());
+        benchmarkOutput("FileOutput to null device", make_shared<tlog::FileOutput>(TLOG_BENCH_NULL_DEVICE));
+
+        const char* path = "tlog-bench.log";
+        benchmarkOutput("FileOutput to disk", make_shared<tlog::FileOutput>(path));
+        benchmarkOutput("JsonOutput to disk", make_shared<tlog::JsonOutput>(path));
+        benchmarkOutput("LogfmtOutput to disk", make_shared<tlog::LogfmtOutput>(path));
+        benchmarkOutput("AsyncOutput to FileOutput to disk", make_shared<tlog::AsyncOutput>(
+            vector<shared_ptr<tlog::IOutput>>{make_shared<tlog::FileOutput>(path)}
+        ));
+        {
+            // Only the cost on the logging thread; the worker renders and writes the records.
+            auto async = make_shared<tlog::AsyncOutput>(vector<shared_ptr<tlog::IOutput>>{make_shared<tlog::FileOutput>(path)});
+            tlog::Logger logger{"bench", {async}};
+            run("logDeferred() to AsyncOutput", [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) {
+                    logger.logDeferred(tlog::ESeverity::Info, [i]() { return "Processed " + to_string(i) + " items"; });
+                }
+                async->flush();
+            });
+        }
+#ifndef _WIN32
+        benchmarkOutput("MmapFileOutput to disk", make_shared<tlog::MmapFileOutput>(path));
+        {
+            auto ring = tlog::SharedMemoryRing::anonymous();
+            tlog::SharedMemoryCollector collector{ring, {make_shared<tlog::FileOutput>(path)}};
+            benchmarkOutput("SharedMemoryOutput to FileOutput to disk", make_shared<tlog::SharedMemoryOutput>(ring));
+        }
+#endif
+        remove(path);
+    }
+
+    void benchmarkRendering() {
+        size_t size = 0;
+
+        run("progressBar()", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                size += tlog::progressBar(i % 1000, 1000, microseconds{(long long)i * 1000}, 80).size();
+            }
+        });
+
+        run("progressBar() into a buffer", [&](uint64_t n) {
+            char buffer[80 + tlog::MAX_PROGRESS_LABEL_SIZE];
+            for (uint64_t i = 0; i < n; ++i) {
+                size += tlog::progressBar(buffer, sizeof(buffer), i % 1000, 1000, microseconds{(long long)i * 1000}, 80);
+            }
+        });
+
+        run("durationToString()", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; ++i) {
+                size += tlog::durationToString(microseconds{(long long)i * 12345}).size();
+            }
+        });
+
+        run("durationToChars()", [&](uint64_t n) {
+            char buffer[tlog::MAX_DURATION_CHARS];
+            for (uint64_t i = 0; i < n; ++i) {
+                size += tlog::durationToChars(buffer, microseconds{(long long)i * 12345});
+            }
+        });
+
+        sink = size;
+    }
+
+    void benchmarkThreads() {
+        auto& logger = *tlog::Logger::global();
+        for (size_t numThreads = 1; numThreads <= options.maxThreads; numThreads *= 2) {
+            runThreads("Logger::global(), " + to_string(numThreads) + " threads", numThreads, [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; ++i) {
+                    logger.info() << "Processed " << i << " items";
+                }
+            });
+        }
+        logger.flush();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-t" && i + 1 < argc) {
+            options.minTime = duration<double>{atof(argv[++i])};
+        } else if (arg == "-j" && i + 1 < argc) {
+            options.maxThreads = (size_t)max(1, atoi(argv[++i]));
+        } else if (!arg.empty() && arg[0] == '-') {
+            cerr << "Usage: " << argv[0] << " [-t <seconds per benchmark>] [-j <max threads>] [<name filter>]" << endl;
+            return EXIT_FAILURE;
+        } else {
+            options.filter = arg;
+        }
+    }
+
+    // Before the console output is created, such that it sees the null device rather than a terminal.
+    if (!freopen(TLOG_BENCH_NULL_DEVICE, "w", stdout)) {
+        cerr << "Could not redirect stdout to " << TLOG_BENCH_NULL_DEVICE << endl;
+        return EXIT_FAILURE;
+    }
+
+    printHeader();
+    benchmarkFrontend();
+    benchmarkOutputs();
+    benchmarkRendering();
+    benchmarkThreads();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,75 @@
+// This file was developed by Thomas Müller <contact@tom94.net>.
+// It is published under the BSD 3-Clause License within the LICENSE.md file.
+
+// Turns logs written by tlog::BinaryFileOutput back into the text tlog::FileOutput would have written.
+// Usage: tlog-decode [-p s|ms|us|ns] <file>...
+
+#include "tinylogger/tinylogger.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+int main(int argc, char* argv[]) {
+    tlog::ETimePrecision precision = tlog::ETimePrecision::Seconds;
+    std::vector<std::string> filenames;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-p" && i + 1 < argc) {
+            std::string value = argv[++i];
+            if (value == "s") {
+                precision = tlog::ETimePrecision::Seconds;
+            } else if (value == "ms") {
+                precision = tlog::ETimePrecision::Milliseconds;
+            } else if (value == "us") {
+                precision = tlog::ETimePrecision::Microseconds;
+            } else if (value == "ns") {
+                precision = tlog::ETimePrecision::Nanoseconds;
+            } else {
+                std::cerr << "Invalid time precision: " << value << std::endl;
+                return EXIT_FAILURE;
+            }
+        } else {
+            filenames.emplace_back(arg);
+        }
+    }
+
+    if (filenames.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [-p s|ms|us|ns] <file>..." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    tlog::TimestampCache timestamp;
+    tlog::detail::PrefixCache prefixes;
+    timestamp.setPrecision(precision);
+
+    int result = EXIT_SUCCESS;
+    std::string text;
+
+    for (const auto& filename : filenames) {
+        std::ifstream file{filename, std::ios::in | std::ios::binary};
+        if (!file) {
+            std::cerr << "Could not open " << filename << std::endl;
+            result = EXIT_FAILURE;
+            continue;
+        }
+
+        std::string data{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+        bool complete = tlog::BinaryFileOutput::decode(data.data(), data.size(), [&](const tlog::Record& record) {
+            text.clear();
+            tlog::FileOutput::appendLine(text, timestamp, prefixes, record);
+            std::cout.write(text.data(), (std::streamsize)text.size());
+        });
+
+        if (!complete) {
+            std::cerr << filename << " is truncated or not a binary log." << std::endl;
+            result = EXIT_FAILURE;
+        }
+    }
+
+    return result;
+}